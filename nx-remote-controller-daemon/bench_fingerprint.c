@@ -0,0 +1,82 @@
+// Host benchmark of the change detection hash: fingerprint() over the whole
+// NV12 frame against the old sum of the first 1440 bytes as signed chars.
+// Built and run by ./build.sh bench, BENCH_CFLAGS=-march=native selects
+// the AVX2 or SSE4.1 kernel, without it the plain C one is measured.
+
+#define main daemon_main
+#include "nx-remote-controller-daemon.c"
+#undef main
+
+#define BENCH_TIME_US 1000000
+#define BENCH_BATCH 16 // calls per clock read
+
+// The hash of the first versions, 720 * 2 luma bytes as signed char.
+static int old_hash(const void *p)
+{
+    const char *c = p;
+    int hash = 0;
+    int j;
+
+    for (j = 0; j < 720 * 2; j++) {
+        hash += c[j];
+    }
+    return hash;
+}
+
+static volatile unsigned int s_sink;
+
+static void bench(const char *name, const unsigned char *buf, size_t size,
+                  size_t stride, bool old)
+{
+    // bytes read per call
+    size_t bytes = old ? 720 * 2 : size / stride * FINGERPRINT_BLOCK_SIZE;
+    long long start = get_monotonic_time_us(), elapsed;
+    unsigned long runs = 0;
+
+    int i;
+
+    do {
+        for (i = 0; i < BENCH_BATCH; i++) {
+            s_sink += old ? (unsigned int)old_hash(buf)
+                          : fingerprint(buf, size, stride);
+        }
+        runs += BENCH_BATCH;
+        elapsed = get_monotonic_time_us() - start;
+    } while (elapsed < BENCH_TIME_US);
+
+    printf("%-24s %8zu bytes  %9.2f us  %8.0f MB/s\n", name, bytes,
+           (double)elapsed / runs, (double)bytes * runs / elapsed);
+}
+
+int main(void)
+{
+    unsigned char *frame = alloc_frame_buffer(VIDEO_FRAME_SIZE);
+    size_t i;
+
+    if (frame == NULL) {
+        die("malloc() failed");
+    }
+    srand(1);
+    for (i = 0; i < VIDEO_FRAME_SIZE; i++) {
+        frame[i] = rand();
+    }
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    printf("fingerprint kernel: NEON\n");
+#elif defined(__AVX2__)
+    printf("fingerprint kernel: AVX2\n");
+#elif defined(__SSE4_1__)
+    printf("fingerprint kernel: SSE4.1\n");
+#else
+    printf("fingerprint kernel: C\n");
+#endif
+    bench("old 1440 bytes", frame, 0, 0, true);
+    bench("frame", frame, VIDEO_FRAME_SIZE, FINGERPRINT_BLOCK_SIZE, false);
+    bench("frame, snapshot stride", frame, VIDEO_FRAME_SIZE,
+          SNAPSHOT_SAMPLE_STRIDE, false);
+    bench("xwin segment", frame, XWIN_SEGMENT_PIXELS * 4,
+          FINGERPRINT_BLOCK_SIZE, false);
+
+    free(frame);
+    return 0;
+}
@@ -0,0 +1,126 @@
+// Host benchmark of the video send paths: write() against vmsplice() and
+// splice() of the daemon's VideoSender, for a heap frame as the capture
+// stages it and for a file-backed mapping, over a loopback TCP socket
+// drained by another thread. Built and run by ./build.sh bench.
+
+#define main daemon_main
+#include "nx-remote-controller-daemon.c"
+#undef main
+
+#define BENCH_TIME_US 1000000
+#define BENCH_READ_SIZE (256 * 1024)
+
+// Reads the socket until the sender closes it.
+static void *drain_thread(void *data)
+{
+    int fd = *(int *)data;
+    static unsigned char buf[BENCH_READ_SIZE];
+
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+static void connect_loopback(int *server_fd, int *client_fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listen_fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 1) == -1 ||
+        getsockname(listen_fd, (struct sockaddr *)&addr, &len) == -1) {
+        die("listen failed");
+    }
+    *client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (*client_fd == -1 ||
+        connect(*client_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        die("connect() failed");
+    }
+    *server_fd = accept(listen_fd, NULL, NULL);
+    if (*server_fd == -1) {
+        die("accept() failed");
+    }
+    close(listen_fd);
+}
+
+static void bench(const char *name, const unsigned char *frame,
+                  int send_method)
+{
+    VideoSender sender;
+    VideoOptions options;
+    pthread_t thread;
+    int server_fd, client_fd;
+    long long start, elapsed, cpu_time;
+    unsigned long frames = 0;
+
+    connect_loopback(&server_fd, &client_fd);
+    if (pthread_create(&thread, NULL, drain_thread, &client_fd)) {
+        die("pthread_create() failed");
+    }
+    video_sender_init(&sender, server_fd);
+    video_options_init(&options);
+    options.send_method = send_method;
+
+    start = get_monotonic_time_us();
+    cpu_time = get_thread_cpu_time_us();
+    do {
+        if (video_sender_send(&sender, &options, frame,
+                              VIDEO_FRAME_SIZE) == -1) {
+            die("send failed");
+        }
+        video_sender_finish_frame(&sender);
+        frames++;
+        elapsed = get_monotonic_time_us() - start;
+    } while (elapsed < BENCH_TIME_US);
+    cpu_time = get_thread_cpu_time_us() - cpu_time;
+
+    printf("%-14s %-6s %7.0f frames/s  %6.0f MB/s  %7.1f cpu us/frame%s\n",
+           name, send_method == VIDEO_SEND_SPLICE ? "splice" : "write",
+           frames * 1e6 / elapsed,
+           (double)frames * VIDEO_FRAME_SIZE / elapsed,
+           (double)cpu_time / frames,
+           sender.splice_disabled ? "  (fell back to write)" : "");
+
+    video_sender_destroy(&sender);
+    close(server_fd);
+    if (pthread_join(thread, NULL)) {
+        die("pthread_join() failed");
+    }
+    close(client_fd);
+}
+
+int main(void)
+{
+    unsigned char *heap = alloc_frame_buffer(VIDEO_FRAME_SIZE);
+    unsigned char *file;
+    FILE *tmp = tmpfile();
+
+    signal(SIGPIPE, SIG_IGN);
+    if (heap == NULL || tmp == NULL ||
+        ftruncate(fileno(tmp), VIDEO_FRAME_SIZE) == -1) {
+        die("frame buffer failed");
+    }
+    file = mmap(NULL, VIDEO_FRAME_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fileno(tmp), 0);
+    if (file == MAP_FAILED) {
+        die("mmap() failed");
+    }
+    memset(heap, 0x80, VIDEO_FRAME_SIZE);
+    memset(file, 0x80, VIDEO_FRAME_SIZE);
+
+    bench("heap frame", heap, VIDEO_SEND_WRITE);
+    bench("heap frame", heap, VIDEO_SEND_SPLICE);
+    bench("file mapping", file, VIDEO_SEND_WRITE);
+    bench("file mapping", file, VIDEO_SEND_SPLICE);
+
+    munmap(file, VIDEO_FRAME_SIZE);
+    fclose(tmp);
+    free(heap);
+    return 0;
+}
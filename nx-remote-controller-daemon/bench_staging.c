@@ -0,0 +1,79 @@
+// Host benchmark of the staging copiers (memcpy, and the NEON vld1 block
+// copiers on ARM) by copy size and by source and destination offset from
+// the STAGING_ALIGN boundary. The LCD mapping is uncached on the camera,
+// here the source is a shared file mapping, so the numbers compare the
+// copiers and alignments, not the bus. Built and run by ./build.sh bench.
+
+#define main daemon_main
+#include "nx-remote-controller-daemon.c"
+#undef main
+
+#define BENCH_ROUNDS 20
+#define BENCH_MAX_OFFSET 64
+
+// Returns the fastest of BENCH_ROUNDS copies in us.
+static double bench_copy(const StagingCopier *copier, unsigned char *dst,
+                         const unsigned char *src, size_t size)
+{
+    long long start, best = -1;
+    int k;
+
+    for (k = 0; k < BENCH_ROUNDS; k++) {
+        start = get_monotonic_time_ns();
+        copier->copy(dst, src, size);
+        start = get_monotonic_time_ns() - start;
+        if (best == -1 || start < best) {
+            best = start;
+        }
+    }
+    if (memcmp(dst, src, size) != 0) {
+        die("copy differs");
+    }
+    return best / 1000.0;
+}
+
+int main(void)
+{
+    static const size_t sizes[] = { 4096, 65536, VIDEO_FRAME_SIZE };
+    static const int offsets[][2] = {
+        {0, 0}, {1, 0}, {4, 0}, {16, 0}, {32, 0}, {0, 1}, {0, 16}, {3, 5},
+    };
+    const size_t map_size = VIDEO_FRAME_SIZE + BENCH_MAX_OFFSET;
+    unsigned char *src, *dst;
+    FILE *tmp = tmpfile();
+    size_t i, j, k;
+    double us;
+
+    dst = alloc_frame_buffer(map_size);
+    if (dst == NULL || tmp == NULL ||
+        ftruncate(fileno(tmp), map_size) == -1) {
+        die("buffer failed");
+    }
+    src = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fileno(tmp), 0);
+    if (src == MAP_FAILED) {
+        die("mmap() failed");
+    }
+    for (i = 0; i < map_size; i++) {
+        src[i] = i * 7;
+    }
+
+    printf("%-8s %7s %4s %4s %9s %7s\n", "copier", "size", "src", "dst",
+           "us", "MB/s");
+    for (i = 0; i < NUM_STAGING_COPIERS; i++) {
+        for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+            for (k = 0; k < sizeof(offsets) / sizeof(offsets[0]); k++) {
+                us = bench_copy(&s_staging_copiers[i], dst + offsets[k][1],
+                                src + offsets[k][0], sizes[j]);
+                printf("%-8s %7zu %4d %4d %9.1f %7.0f\n",
+                       s_staging_copiers[i].name, sizes[j], offsets[k][0],
+                       offsets[k][1], us, sizes[j] / us);
+            }
+        }
+    }
+
+    munmap(src, map_size);
+    fclose(tmp);
+    free(dst);
+    return 0;
+}
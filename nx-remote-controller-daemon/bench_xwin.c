@@ -0,0 +1,77 @@
+// Host benchmark of the OSD grabbers: grab_xshm_frame() against
+// grab_xwd_frame() on $DISPLAY, e.g. under "Xvfb :1 -screen 0 720x480x24".
+// Skipped without an X server, without MIT-SHM or without xwd. Built and
+// run by ./build.sh bench, with USE_XSHM if the X headers are installed.
+
+#define main daemon_main
+#include "nx-remote-controller-daemon.c"
+#undef main
+
+#define BENCH_GRABS 50
+
+// Returns the average time of a grab in us, or -1 if one failed.
+static double bench_grab(XwinCapture *capture, unsigned char *data,
+                         bool xshm)
+{
+    long long start = get_monotonic_time_us();
+    bool ok;
+    int i;
+
+    for (i = 0; i < BENCH_GRABS; i++) {
+#ifdef USE_XSHM
+        ok = xshm ? grab_xshm_frame(capture, data) : grab_xwd_frame(data);
+#else
+        (void)capture;
+        (void)xshm;
+        ok = grab_xwd_frame(data);
+#endif
+        if (!ok) {
+            return -1;
+        }
+    }
+    return (double)(get_monotonic_time_us() - start) / BENCH_GRABS;
+}
+
+static void print_grab(const char *name, double us)
+{
+    if (us < 0) {
+        printf("%-6s skipped, the grab failed\n", name);
+    } else {
+        printf("%-6s %9.0f us/frame  %6.1f fps max\n", name, us, 1e6 / us);
+    }
+}
+
+int main(void)
+{
+    XwinCapture *capture = &s_xwin_capture;
+    unsigned char *data = malloc(XWIN_FRAME_SIZE);
+
+    if (data == NULL) {
+        die("malloc() failed");
+    }
+    if (getenv("DISPLAY") == NULL) {
+        printf("bench_xwin: skipped, no DISPLAY\n");
+        return 0;
+    }
+
+#ifdef USE_XSHM
+    if (!xshm_open(capture)) {
+        printf("bench_xwin: skipped, no X server with MIT-SHM\n");
+        return 0;
+    }
+    print_grab("xshm", bench_grab(capture, data, true));
+#else
+    printf("xshm   skipped, built without USE_XSHM\n");
+#endif
+    if (system("command -v xwd > /dev/null") != 0) {
+        printf("xwd    skipped, no xwd\n");
+    } else {
+        print_grab("xwd", bench_grab(capture, data, false));
+    }
+
+#ifdef USE_XSHM
+    xshm_close(capture);
+#endif
+    free(data);
+    return 0;
+}
@@ -2,6 +2,49 @@
 
 export PATH=$PATH:/home/mewlips/devices/nx500/NX500_opensource/kernel/CodeSourcery/Sourcery_CodeBench_Lite_for_ARM_GNU_Linux/bin
 
-arm-none-linux-gnueabi-gcc nx-remote-controller-daemon.c -DDEBUG -O4 -Wall -lpthread -o nx-remote-controller-daemon && \
+# ./build.sh test builds the test_*.c programs for the host and runs them,
+# they include the daemon source. test_stubs/ has the headers of the X
+# extensions whose calls the tests stub.
+if [ "$1" = "test" ]; then
+    mkdir -p host
+    for test in test_*.c; do
+        gcc $test -Itest_stubs -O2 -Wall -Wno-unused-function -lpthread -lrt -o host/${test%.c} && \
+            host/${test%.c} || exit 1
+    done
+    exit 0
+fi
+
+# ./build.sh bench does the same with the bench_*.c programs, add
+# BENCH_CFLAGS=-march=native to measure the SIMD kernels of the host. The
+# X grabbers are measured with MIT-SHM if the host has the X libraries.
+if [ "$1" = "bench" ]; then
+    mkdir -p host
+    if pkg-config --exists x11 xext 2> /dev/null; then
+        HOST_XSHM_FLAGS="-DUSE_XSHM $(pkg-config --cflags --libs x11 xext)"
+    fi
+    for bench in bench_*.c; do
+        gcc $bench -O2 -Wall -Wno-unused-function $BENCH_CFLAGS $HOST_XSHM_FLAGS \
+            -lpthread -lrt -o host/${bench%.c} && host/${bench%.c} || exit 1
+    done
+    exit 0
+fi
+
+# mode=jpeg needs libjpeg-turbo from the buildroot build (../buildroot/build.sh),
+# linked statically so that the daemon doesn't depend on the tools chroot
+BUILDROOT_STAGING=../buildroot/buildroot-2016.05/output/staging/usr
+if [ -f $BUILDROOT_STAGING/lib/libjpeg.a ]; then
+    JPEG_FLAGS="-DUSE_LIBJPEG -I$BUILDROOT_STAGING/include $BUILDROOT_STAGING/lib/libjpeg.a"
+fi
+
+# the OSD is read with MIT-SHM if libXext is there, the sonames are the same
+# as of the X libraries of the camera
+if [ -f $BUILDROOT_STAGING/lib/libXext.so ]; then
+    XSHM_FLAGS="-DUSE_XSHM -I$BUILDROOT_STAGING/include -L$BUILDROOT_STAGING/lib -lXext -lX11"
+    if [ -f $BUILDROOT_STAGING/lib/libXdamage.so ]; then
+        XSHM_FLAGS="$XSHM_FLAGS -DUSE_XDAMAGE -lXdamage -lXfixes"
+    fi
+fi
+
+arm-none-linux-gnueabi-gcc nx-remote-controller-daemon.c -DDEBUG -O4 -Wall -mfpu=neon -mfloat-abi=softfp $JPEG_FLAGS $XSHM_FLAGS -lpthread -lrt -o nx-remote-controller-daemon && \
      cp -fv nx-remote-controller-daemon ../install/app/ && \
      cp -fv nx-remote-controller-daemon ../sd_install/remote/
@@ -1,20 +1,56 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/sockios.h>
+#include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef USE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+#ifdef USE_XSHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#endif
+
+#ifdef USE_XDAMAGE
+#ifndef USE_XSHM
+#error "USE_XDAMAGE needs USE_XSHM"
+#endif
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__) || defined(__SSE4_1__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #ifdef DEBUG
 #define log(fmt, ...) \
     do { \
@@ -43,16 +79,196 @@ static void print_error(const char *msg)
 #define MMAP_SIZE 522496
 #define MMAP_SIZE_2 695296
 
+// video stream modes, selected by the client with "mode=" on the video socket
+#define VIDEO_MODE_RAW 0   // whole NV12 frames without header (default)
+#define VIDEO_MODE_TILE 1  // only the changed tiles, framed (VIDEO_MSG_TILES)
+#define VIDEO_MODE_FRAME 2 // whole NV12 frames, framed (VIDEO_MSG_FRAME)
+#define VIDEO_MODE_JPEG 3  // JPEG per frame, framed (VIDEO_MSG_JPEG), USE_LIBJPEG
+#define VIDEO_MODE_PROGRESSIVE 4 // coarse to fine layers (VIDEO_MSG_LAYER)
+
+// framed video message header (big endian)
+//   MAGIC(4) TYPE(1) BUFFER(1) COUNT(2) SEQUENCE(4) TIMESTAMP(8)
+//   WIDTH(2) HEIGHT(2) PAYLOAD_SIZE(4)
+// SEQUENCE increases by one per captured frame, TIMESTAMP is the capture time
+// in microseconds (CLOCK_MONOTONIC) and BUFFER the source LCD buffer index.
+#define VIDEO_MSG_MAGIC 0x4e585646 // "NXVF"
+#define VIDEO_MSG_HEADER_SIZE 28
+#define VIDEO_MSG_TILES 1
+#define VIDEO_MSG_FRAME 2 // payload is the NV12 frame
+#define VIDEO_MSG_JPEG 3  // payload is a JFIF image of WIDTH x HEIGHT
+#define VIDEO_MSG_LAYER 4 // COUNT is the layer index, see below
+#define VIDEO_MSG_TRANSPORT 5 // COUNT is the UDP port, 0 = TCP, no payload
+#define VIDEO_MSG_ANALYTICS 6 // analytics port, COUNT is ANALYTICS_BINS
+#define VIDEO_MSG_PEAKING 7   // edge mask, COUNT is the threshold
+#define VIDEO_MSG_RECTS 8     // xwin XWIN_MODE_RECT, see below
+
+// Focus peaking, "peaking=on|off" and "peaking_threshold=1..254" on the
+// video socket. After each frame of a framed mode, a VIDEO_MSG_PEAKING
+// message carries the edge mask of the crop rectangle at full resolution
+// (WIDTH x HEIGHT, not scaled). A pixel is an edge if |dx| + |dy| of its
+// luma neighbours is above the threshold. The payload is the row major
+// mask as run lengths, alternating non-edge and edge and starting with
+// non-edge (may be 0), each a varint of 7 bits per byte, low bits first,
+// with the high bit set if more bytes follow.
+#define VIDEO_PEAKING_THRESHOLD 40
+// the SIMD kernels saturate |dx| + |dy| at 255, higher values are clamped
+#define VIDEO_PEAKING_THRESHOLD_MAX 254
+#define VIDEO_PEAKING_BUF_SIZE (FRAME_WIDTH * FRAME_HEIGHT + 1)
+
+// VIDEO_MSG_LAYER payload is one layer of a WIDTH x HEIGHT NV12 image.
+// Each layer is a plane sampled on a grid of STEP x STEP, in rows:
+//   layer  0  1  2  3  4  5  6
+//   plane  Y  UV Y  UV Y  UV Y
+//   step   8  4  4  2  2  1  1
+// UV steps count VU pairs, so both planes of layer 1 are at 1/8 scale.
+// Layers 0 and 1 hold the whole grid, the others only the samples that
+// are not on the grid of the previous layer of the same plane (odd
+// multiples of STEP in rows that are even multiples of STEP). Once layer
+// 6 arrived the image is complete. When a newer frame is captured, the
+// rest of the layers are not sent and the newer frame starts at layer 0.
+#define VIDEO_LAYERS 7
+// Each layer of a frame is packed into its own part of the buffer, as
+// spliced pages stay referenced by the socket until the frame is finished.
+// The layers hold every sample once, so they add up to the image size.
+#define VIDEO_LAYER_BUF_SIZE VIDEO_FRAME_SIZE
+
+// "quality=1..100" and "subsampling=420|422|444" for VIDEO_MODE_JPEG
+#define VIDEO_JPEG_QUALITY 75
+#define VIDEO_JPEG_SUBSAMPLING 420
+
+// the capture thread has this core to itself, see pin_off_capture_cpu()
+#define VIDEO_CAPTURE_CPU 0
+
+// VIDEO_MSG_TILES payload is COUNT tiles of
+//   X(2) Y(2) + TILE_SIZE rows of Y + TILE_SIZE/2 rows of interleaved UV
+// Tiles on the right and bottom edges are cut to the image size.
+#define VIDEO_TILE_SIZE 16
+#define VIDEO_TILES_X (FRAME_WIDTH / VIDEO_TILE_SIZE)
+#define VIDEO_TILES_Y (FRAME_HEIGHT / VIDEO_TILE_SIZE)
+#define VIDEO_TILE_Y_SIZE (VIDEO_TILE_SIZE * VIDEO_TILE_SIZE)
+#define VIDEO_TILE_UV_SIZE (VIDEO_TILE_SIZE * VIDEO_TILE_SIZE / 2)
+#define VIDEO_TILE_MSG_SIZE (4 + VIDEO_TILE_Y_SIZE + VIDEO_TILE_UV_SIZE)
+#define VIDEO_TILE_BUF_SIZE (VIDEO_MSG_HEADER_SIZE + \
+        VIDEO_TILES_X * VIDEO_TILES_Y * VIDEO_TILE_MSG_SIZE)
+
+// how video data is handed to the kernel, "send=" on the video socket
+#define VIDEO_SEND_WRITE 0  // write() (default)
+#define VIDEO_SEND_SPLICE 1 // vmsplice() + splice(), no user to kernel copy
+#define VIDEO_SPLICE_MIN_SIZE 4096
+#define VIDEO_SPLICE_PIPE_SIZE (1024 * 1024)
+#define VIDEO_SPLICE_DRAIN_TIMEOUT_MS 2000
+
+// "transport=udp:<port>|tcp" on the video socket. With UDP, each framed
+// message is sent to <port> of the client address as datagrams of
+//   MAGIC(4) MESSAGE_ID(4) FRAGMENT(2) FRAGMENT_COUNT(2) + up to
+//   VIDEO_UDP_DATA_SIZE bytes of the message
+// MESSAGE_ID increases by one per message, so a client drops a message
+// whose fragments are not complete when a newer one is. Only the frame,
+// jpeg and progressive modes use UDP, tile and raw mode need every byte.
+// A VIDEO_MSG_TRANSPORT message on the TCP socket tells the client where
+// the following messages go. If the client port is unreachable, the
+// stream falls back to TCP until the client selects a transport again.
+#define VIDEO_UDP_MAGIC 0x4e585655 // "NXVU"
+#define VIDEO_UDP_HEADER_SIZE 12
+#define VIDEO_UDP_DATA_SIZE (1400 - VIDEO_UDP_HEADER_SIZE)
+#define VIDEO_UDP_SNDBUF_SIZE (1024 * 1024)
+
+// server side crop and downscale: "crop=x,y,w,h|off", "scale=1|2|4|8" and
+// "size=WxH" on the video socket. WIDTH and HEIGHT of framed messages are
+// the output size, raw mode sends the scaled NV12 image as is.
+// Framed modes start from the active area of the frame (see
+// get_active_area()) and crop within it.
+
+#define VIDEO_OPTION_LINE_MAX 128
+#define VIDEO_OPTIONS_TIMEOUT_MS 100
+
+// adaptive frame rate, "fps_min=" and "fps_max=" on the video socket and
+// "xfps_min=" and "xfps_max=" executor commands for xwin. The rate in use is
+// reported as "video_fps=" and "xwin_fps=" on the notify socket. With
+// "transport=udp" it follows the UDP socket, see AdaptiveRate.
+#define ADAPTIVE_FPS_MIN 1
+
+// The analytics port sends a VIDEO_MSG_ANALYTICS message per captured frame
+// of the active area, without streaming the frame. Payload (big endian):
+//   PIXELS(4) UNDER(4) OVER(4) Y_SUM(4) Y_MIN(1) Y_MAX(1) RESERVED(2)
+//   HISTOGRAM(4 * ANALYTICS_BINS)
+// followed after "uv=on" by
+//   U_SUM(4) V_SUM(4) U_MIN(1) U_MAX(1) V_MIN(1) V_MAX(1)
+// UNDER and OVER count the luma samples <= and >= the levels set with
+// "clip=<under>,<over>", each histogram bin covers 256 / ANALYTICS_BINS
+// levels. Chroma sums are over the (width / 2) x (height / 2) samples.
+// With the 28 byte header a message is 304 bytes, 316 with chroma.
+#define ANALYTICS_BINS 64
+#define ANALYTICS_UNDER_LEVEL 16  // BT.601 black
+#define ANALYTICS_OVER_LEVEL 235  // BT.601 white
+#define ANALYTICS_LUMA_SIZE (20 + 4 * ANALYTICS_BINS)
+#define ANALYTICS_CHROMA_SIZE 12
+
+// Motion detector on the luma of the video capture, executor commands
+//   motion=on|off
+//   motion_roi=x,y,w,h  adds a region of the active area, "off" clears them
+//   motion_sensitivity=1..100
+//   motion_action=<line>  sent to nx-input-injector on motion, "off" clears
+// The luma is averaged over MOTION_CELL_SIZE cells and compared with a
+// background that follows the scene slowly. Motion is reported as
+// "motion=on" and "motion=off" on the notify socket. It works with no
+// video connection, at MOTION_FPS if no stream asks for more.
+#define MOTION_FPS 5
+#define MOTION_CELL_SIZE 8
+#define MOTION_GRID_WIDTH (FRAME_WIDTH / MOTION_CELL_SIZE)
+#define MOTION_GRID_HEIGHT (FRAME_HEIGHT / MOTION_CELL_SIZE)
+#define MOTION_MAX_ROIS 4
+#define MOTION_SENSITIVITY 50
+#define MOTION_BACKGROUND_SHIFT 4 // the background moves 1/16 per frame
+#define MOTION_WARMUP_FRAMES 2
+#define MOTION_HOLD_MS 2000 // motion=off after this long without motion
+#define MOTION_ACTION_MAX 128
+
 #define XWIN_SEGMENT_PIXELS 320
 #define XWIN_BUF_SIZE (2 + XWIN_SEGMENT_PIXELS * 4) // 2 bytes (INDEX) + 320 pixels (BGRA)
 #define XWIN_NUM_SEGMENTS (FRAME_WIDTH * FRAME_HEIGHT / XWIN_SEGMENT_PIXELS)
 #define XWIN_FRAME_SIZE (FRAME_WIDTH * FRAME_HEIGHT * 4)
 
+// xwin stream modes, selected by the client with "mode=" on the xwin socket
+#define XWIN_MODE_SEGMENT 0 // changed XWIN_SEGMENT_PIXELS strips (default)
+#define XWIN_MODE_RECT 1    // changed rectangles, framed (VIDEO_MSG_RECTS)
+
+// "encoding=raw|rle" on the xwin socket, for XWIN_MODE_SEGMENT. With rle, a
+// segment that gets smaller is sent as
+//   INDEX | XWIN_RLE_FLAG (2) SIZE(2) + SIZE bytes of runs
+// instead of INDEX(2) + the BGRA pixels. Each run starts with a byte C:
+//   0x00-0x7f  C + 1 pixels follow
+//   0x80-0xbf  (C & 0x3f) + 1 transparent pixels (all 4 bytes 0)
+//   0xc0-0xff  (C & 0x3f) + 1 times the pixel that follows
+// The end of frame marker is always raw.
+#define XWIN_ENCODING_RAW 0
+#define XWIN_ENCODING_RLE 1
+#define XWIN_RLE_FLAG 0x8000
+#define XWIN_RLE_HEADER_SIZE 4
+#define XWIN_RLE_MAX_LITERAL 128
+#define XWIN_RLE_MAX_RUN 64
+#define XWIN_OUT_BUF_SIZE (16 * XWIN_BUF_SIZE) // segments per write()
+
+// VIDEO_MSG_RECTS payload is COUNT rectangles of
+//   X(2) Y(2) WIDTH(2) HEIGHT(2) + HEIGHT rows of WIDTH BGRA pixels
+// Changes are found on a grid of XWIN_TILE_SIZE tiles. Runs of changed
+// tiles in a tile row are merged, and so are runs of the same columns in
+// the rows below. The first frame is the whole screen, frames without
+// changes are not sent.
+#define XWIN_TILE_SIZE 16
+#define XWIN_TILES_X (FRAME_WIDTH / XWIN_TILE_SIZE)
+#define XWIN_TILES_Y (FRAME_HEIGHT / XWIN_TILE_SIZE)
+#define XWIN_NUM_TILES (XWIN_TILES_X * XWIN_TILES_Y)
+#define XWIN_RECT_HEADER_SIZE 8
+#define XWIN_RECT_BUF_SIZE (VIDEO_MSG_HEADER_SIZE + XWIN_FRAME_SIZE + \
+        XWIN_NUM_TILES * XWIN_RECT_HEADER_SIZE)
+
 #define PORT_NOTIFY 5677
 #define PORT_VIDEO 5678
 #define PORT_XWIN 5679
 #define PORT_EXECUTOR 5680
 #define PORT_UDP_BROADCAST 5681
+#define PORT_ANALYTICS 5682
 
 #define XWD_SKIP_BYTES 3179
 #define DISCOVERY_PACKET_SIZE 32
@@ -71,10 +287,26 @@ static void print_error(const char *msg)
         CHROOT_COMMAND "xev-nx -p -id " \
         GET_DI_CAMERA_APP_WINDOW_ID_COMMAND
 
+#define HEVC_STATE_PATH "/sys/kernel/debug/pmu/hevc/state"
 #define HEVC_STATE_UNKNOWN (-1)
 #define HEVC_STATE_OFF 0
 #define HEVC_STATE_ON  1
 
+#define GET_MOVIE_SIZE_COMMAND "prefman get 0 0x0000a360 l"
+#define MOVIE_SIZE_UNKNOWN (-1)
+#define MOVIE_SIZE_FHD_HD 0
+#define MOVIE_SIZE_UHD 1
+#define MOVIE_SIZE_VGA 2
+
+// While recording, only the top of the LCD buffer is image, packed with the
+// active width. VGA movies are 640 wide also in standby, as the client
+// crops them.
+#define ACTIVE_HEIGHT_FHD_HD 404
+#define ACTIVE_HEIGHT_UHD 380
+#define ACTIVE_WIDTH_VGA 640
+#define ACTIVE_AREA_CHECK_INTERVAL_MS 1000
+#define MOVIE_SIZE_CHECK_INTERVAL_MS 5000 // in standby
+
 #define PING_TIMEOUT_MS 5000
 
 static off_t s_addrs[] = {
@@ -94,7 +326,7 @@ static off_t s_addrs[] = {
 //    0x9f8f7000,
 };
 
-#define S_ADDRS_SIZE sizeof(s_addrs)
+#define S_ADDRS_SIZE (sizeof(s_addrs) / sizeof(s_addrs[0]))
 
 typedef struct {
     int server_fd;
@@ -108,8 +340,16 @@ typedef struct {
     int port;
     OnConnect on_connect;
     int *socket_connect_count;
+    bool multi_client; // serve clients concurrently instead of one by one
 } ListenSocketData;
 
+typedef struct {
+    int port;
+    OnConnect on_connect;
+    int *socket_connect_count;
+    StreamerData *data;
+} ConnectionData;
+
 static char *get_port_name(int port)
 {
     switch (port) {
@@ -123,15 +363,123 @@ static char *get_port_name(int port)
             return "executor";
         case PORT_UDP_BROADCAST:
             return "discovery";
+        case PORT_ANALYTICS:
+            return "analytics";
     }
 
     return "unknown";
 }
 
+// Returns HEVC_STATE_ON while a movie is being recorded.
+static int read_hevc_state(FILE *hevc)
+{
+    char buf[16];
+
+    clearerr(hevc);
+    rewind(hevc);
+    memset(buf, 0, sizeof(buf));
+    fread(buf, 1, sizeof(buf) - 1, hevc);
+    if (ferror(hevc) != 0) {
+        log("ferror()");
+    } else if (feof(hevc) != 0) {
+        if (strncmp(buf, "on", 2) == 0) {
+            return HEVC_STATE_ON;
+        } else if (strncmp(buf, "off", 3) == 0) {
+            return HEVC_STATE_OFF;
+        }
+    }
+
+    return HEVC_STATE_UNKNOWN;
+}
+
+// Reads the movie size setting. The value starts at offset 29 of the
+// "[app] in memory: ..." line, as parsed by the client.
+static int read_movie_size(void)
+{
+    FILE *prefman;
+    char buf[64];
+    int movie_size = MOVIE_SIZE_UNKNOWN;
+
+    prefman = popen(GET_MOVIE_SIZE_COMMAND, "r");
+    if (prefman == NULL) {
+        print_error("popen() failed");
+        return MOVIE_SIZE_UNKNOWN;
+    }
+
+    if (fgets(buf, sizeof(buf), prefman) != NULL &&
+        strncmp(buf, "[app] in memory:", 16) == 0 && strlen(buf) > 30) {
+        if (buf[29] == '0') {
+            movie_size = MOVIE_SIZE_UHD;
+        } else if (buf[29] == '9' || strncmp(buf + 29, "10", 2) == 0 ||
+                   strncmp(buf + 29, "11", 2) == 0) {
+            movie_size = MOVIE_SIZE_VGA;
+        } else {
+            movie_size = MOVIE_SIZE_FHD_HD;
+        }
+    }
+
+    if (pclose(prefman) == -1) {
+        print_error("pclose() failed");
+    }
+    log("movie size = %d", movie_size);
+
+    return movie_size;
+}
+
+static void get_active_area(int hevc_state, int movie_size,
+                            int *width, int *height)
+{
+    *width = FRAME_WIDTH;
+    *height = FRAME_HEIGHT;
+
+    if (movie_size == MOVIE_SIZE_VGA) {
+        *width = ACTIVE_WIDTH_VGA;
+    } else if (hevc_state == HEVC_STATE_ON &&
+               movie_size == MOVIE_SIZE_FHD_HD) {
+        *height = ACTIVE_HEIGHT_FHD_HD;
+    } else if (hevc_state == HEVC_STATE_ON && movie_size == MOVIE_SIZE_UHD) {
+        *height = ACTIVE_HEIGHT_UHD;
+    }
+}
+
+// Reads the recording state and the movie size now, for callers that don't
+// follow them like the capture thread does.
+static void read_active_area(int *width, int *height)
+{
+    FILE *hevc;
+    int hevc_state = HEVC_STATE_UNKNOWN;
+
+    hevc = fopen(HEVC_STATE_PATH, "r");
+    if (hevc == NULL) {
+        print_error("fopen() failed");
+    } else {
+        hevc_state = read_hevc_state(hevc);
+        if (fclose(hevc)) {
+            print_error("fclose() failed");
+        }
+    }
+    get_active_area(hevc_state, read_movie_size(), width, height);
+}
+
+static in_addr_t get_peer_addr(int fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    if (getpeername(fd, (struct sockaddr *)&addr, &len) == -1 ||
+        addr.sin_family != AF_INET) {
+        return INADDR_NONE;
+    }
+    return addr.sin_addr.s_addr;
+}
+
+// defined with the capture hubs below
+static int get_adaptive_fps(int port, in_addr_t peer_addr);
+
 static bool s_video_socket_closed_notify;
 static bool s_xwin_socket_closed_notify;
 static bool s_executor_socket_closed_notify;
-static bool s_video_socket_close_request;
+static volatile bool s_motion_active; // set by the motion detector
 
 static void *start_notify(StreamerData *data)
 {
@@ -144,12 +492,17 @@ static void *start_notify(StreamerData *data)
     pid_t xev_pid = 0;
     FILE *hevc = NULL;
     int hevc_state = HEVC_STATE_UNKNOWN;
+    int state;
     char *line;
     int count = 0;
+    in_addr_t peer_addr = get_peer_addr(client_fd);
+    int video_fps = 0, xwin_fps = 0;
+    int fps;
+    bool motion_active = false;
 
     free(data);
 
-    hevc = fopen("/sys/kernel/debug/pmu/hevc/state", "r");
+    hevc = fopen(HEVC_STATE_PATH, "r");
     if (hevc == NULL) {
         print_error("fopen() failed");
         goto error;
@@ -177,31 +530,23 @@ static void *start_notify(StreamerData *data)
 
     while (true) {
         // hevc check
-        clearerr(hevc);
-        rewind(hevc);
-        memset(buf, 0, sizeof(buf));
-        fread(buf, 1, sizeof(buf), hevc);
-        if (ferror(hevc) != 0) {
-            log("ferror()");
-        } else if (feof(hevc) != 0) {
-            //log("read_size = %d, buf = %s", read_size, buf);
-            if (strncmp(buf, "on", 2) == 0) {
-                if (hevc_state != HEVC_STATE_ON) {
-                    hevc_state = HEVC_STATE_ON;
-                    write_size = write(client_fd, "hevc=on\n", 8);
-                    if (write_size == -1) {
-                        print_error("write() failed!");
-                        goto error;
-                    }
+        state = read_hevc_state(hevc);
+        if (state == HEVC_STATE_ON) {
+            if (hevc_state != HEVC_STATE_ON) {
+                hevc_state = HEVC_STATE_ON;
+                write_size = write(client_fd, "hevc=on\n", 8);
+                if (write_size == -1) {
+                    print_error("write() failed!");
+                    goto error;
                 }
-            } else if (strncmp(buf, "off", 3) == 0) {
-                if (hevc_state != HEVC_STATE_OFF) {
-                    hevc_state = HEVC_STATE_OFF;
-                    write_size = write(client_fd, "hevc=off\n", 9);
-                    if (write_size == -1) {
-                        print_error("write() failed!");
-                        goto error;
-                    }
+            }
+        } else if (state == HEVC_STATE_OFF) {
+            if (hevc_state != HEVC_STATE_OFF) {
+                hevc_state = HEVC_STATE_OFF;
+                write_size = write(client_fd, "hevc=off\n", 9);
+                if (write_size == -1) {
+                    print_error("write() failed!");
+                    goto error;
                 }
             }
         }
@@ -225,6 +570,39 @@ static void *start_notify(StreamerData *data)
             //log("buf = %s", buf);
         }
 
+        // adaptive frame rates of the streams of this client
+        fps = get_adaptive_fps(PORT_VIDEO, peer_addr);
+        if (fps != video_fps) {
+            video_fps = fps;
+            snprintf(buf, sizeof(buf), "video_fps=%d\n", fps);
+            write_size = write(client_fd, buf, strlen(buf));
+            if (write_size == -1) {
+                log("write() failed!");
+                break;
+            }
+        }
+        fps = get_adaptive_fps(PORT_XWIN, peer_addr);
+        if (fps != xwin_fps) {
+            xwin_fps = fps;
+            snprintf(buf, sizeof(buf), "xwin_fps=%d\n", fps);
+            write_size = write(client_fd, buf, strlen(buf));
+            if (write_size == -1) {
+                log("write() failed!");
+                break;
+            }
+        }
+
+        if (s_motion_active != motion_active) {
+            motion_active = s_motion_active;
+            snprintf(buf, sizeof(buf), "motion=%s\n",
+                     motion_active ? "on" : "off");
+            write_size = write(client_fd, buf, strlen(buf));
+            if (write_size == -1) {
+                log("write() failed!");
+                break;
+            }
+        }
+
         if (s_video_socket_closed_notify) {
             char msg[] = "socket_closed=video\n";
             write_size = write(client_fd, msg, strlen(msg));
@@ -312,264 +690,4838 @@ static long long get_current_time()
     return milliseconds;
 }
 
-static int s_video_fps;
-static void *start_video_capture(StreamerData *data)
+static long long get_monotonic_time_us()
 {
-    int client_fd = data->client_fd;
-    s_video_fps = data->fps;
-    int fd;
-    void *addrs[S_ADDRS_SIZE];
-    int hashs[S_ADDRS_SIZE] = {0,};
-    int i, j, hash;
-    long long start_time, end_time, time_diff;
-    long long frame_time = 1000ll / (long)s_video_fps;
-#ifdef DEBUG
-    long long capture_start_time, capture_end_time;
-#endif
-    bool err = false;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-    free(data);
+static long long get_thread_cpu_time_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-    fd = open("/dev/mem", O_RDWR);
-    if (fd == -1) {
-        die("open() error");
+// Pins the calling thread to the online CPUs in [first, last].
+// Does nothing on single core systems.
+static void set_thread_cpus(int first, int last)
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    int i;
+
+    if (num_cpus < 2) {
+        return;
     }
 
-    for (i = 0; i < S_ADDRS_SIZE; i++) {
-        addrs[i] = mmap_lcd(fd, s_addrs[i]);
+    CPU_ZERO(&cpus);
+    for (i = first; i <= last && i < num_cpus; i++) {
+        CPU_SET(i, &cpus);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        log("pthread_setaffinity_np() failed");
     }
+}
 
-#ifdef DEBUG
-    capture_start_time = get_current_time();
-#endif
-    s_video_socket_close_request = false;
-    while (true) {
-        start_time = get_current_time();
+// Keeps the calling thread off VIDEO_CAPTURE_CPU, so that sending, scaling,
+// encoding and analysis never delay the capture ticks. Called by main(),
+// every thread it starts and every command they run inherit it. The frame
+// hub subscribers call it again, they must not depend on who started them.
+static void pin_off_capture_cpu(void)
+{
+    set_thread_cpus(VIDEO_CAPTURE_CPU + 1, CPU_SETSIZE - 1);
+}
 
-        if (s_video_socket_close_request) {
-            s_video_socket_close_request = false;
-            break;
-        }
+// Frame pacing on absolute CLOCK_MONOTONIC deadlines, so the rate doesn't
+// drift with the time spent in each tick. After an overrun the missed
+// deadlines are skipped instead of being caught up with a burst. How late
+// each wakeup is goes to a histogram with upper bounds PACER_JITTER_BINS_US.
+#define PACER_JITTER_BINS 8
+static const long PACER_JITTER_BINS_US[PACER_JITTER_BINS - 1] = {
+    100, 500, 1000, 2000, 5000, 10000, 20000
+};
 
-        for (i = 0; i < S_ADDRS_SIZE; i++) {
-            const char *p = addrs[i];
+typedef struct {
+    long long deadline; // ns, 0 before the first tick
+    unsigned long ticks;
+    unsigned long skipped;
+    unsigned long jitter[PACER_JITTER_BINS];
+} Pacer;
 
-            hash = 0;
-            for (j = 0; j < 720*2; j++) {
-                hash += p[j];
-            }
-            if (hashs[i] != 0 && hash != hashs[i]) {
-                if (write(client_fd, p, VIDEO_FRAME_SIZE) == -1) {
-                    log("write() failed!");
-                    err = true;
-                    break;
-                }
-                //log("[VideoCapture] %d, hash = %d (changed!)", i, hash);
-            }
+static Pacer s_video_pacer;
+static Pacer s_xwin_pacer;
 
-            hashs[i] = hash;
-        }
+static long long get_monotonic_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-        end_time = get_current_time();
+// Starts a new run of ticks, the statistics are kept.
+static void pacer_reset(Pacer *pacer)
+{
+    pacer->deadline = 0;
+}
 
-        time_diff = end_time - start_time;
-        if (time_diff < frame_time) {
-            //log("sleep %lld ms", frame_time - time_diff);
-            usleep((frame_time - time_diff) * 1000);
-        }
-        frame_time = 1000ll / (long)s_video_fps;
+// Sleeps until the next tick at fps.
+static void pacer_wait(Pacer *pacer, int fps)
+{
+    const long long interval = 1000000000LL / (fps > 0 ? fps : 1);
+    long long now = get_monotonic_time_ns();
+    long long missed;
+    struct timespec ts;
+    long late_us;
+    int i;
+
+    if (pacer->deadline == 0) {
+        pacer->deadline = now;
+    }
+    pacer->deadline += interval;
+    if (pacer->deadline <= now) {
+        missed = (now - pacer->deadline) / interval + 1;
+        pacer->deadline += missed * interval;
+        pacer->skipped += missed;
+    }
+
+    ts.tv_sec = pacer->deadline / 1000000000LL;
+    ts.tv_nsec = pacer->deadline % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
 
-        if (err) {
+    late_us = (get_monotonic_time_ns() - pacer->deadline) / 1000;
+    for (i = 0; i < PACER_JITTER_BINS - 1; i++) {
+        if (late_us < PACER_JITTER_BINS_US[i]) {
             break;
         }
     }
+    pacer->jitter[i]++;
+    pacer->ticks++;
+}
 
-#ifdef DEBUG
-    capture_end_time = get_current_time();
-    log("time = %f", (capture_end_time - capture_start_time) / 1000.0);
-#endif
+// Frame fingerprint: xxHash32 style rounds on 16 independent 32-bit lanes.
+// Each FINGERPRINT_BLOCK_SIZE block feeds one little-endian word per lane,
+// so the NEON, SSE4.1, AVX2 and plain C versions give the same result.
+#define FINGERPRINT_PRIME1 2654435761U
+#define FINGERPRINT_PRIME2 2246822519U
+#define FINGERPRINT_PRIME3 3266489917U
+#define FINGERPRINT_LANES 16
+#define FINGERPRINT_BLOCK_SIZE (FINGERPRINT_LANES * 4)
+
+static inline unsigned int rotl32(unsigned int x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+static void fingerprint_lanes_init(unsigned int lanes[FINGERPRINT_LANES])
+{
+    int i;
+
+    for (i = 0; i < FINGERPRINT_LANES; i++) {
+        lanes[i] = FINGERPRINT_PRIME1 * (i + 1);
+    }
+}
+
+// Hashes one FINGERPRINT_BLOCK_SIZE block every stride bytes of [p, p + size).
+// size and stride must be multiples of FINGERPRINT_BLOCK_SIZE.
+static void fingerprint_lanes_update(unsigned int lanes[FINGERPRINT_LANES],
+                                     const unsigned char *p, size_t size,
+                                     size_t stride)
+{
+    const unsigned char *end = p + size;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    const uint32x4_t prime1 = vdupq_n_u32(FINGERPRINT_PRIME1);
+    const uint32x4_t prime2 = vdupq_n_u32(FINGERPRINT_PRIME2);
+    uint32x4_t acc[4];
+    int i;
 
     for (i = 0; i < 4; i++) {
-        munmap_lcd(addrs[i], s_addrs[i]);
+        acc[i] = vld1q_u32(lanes + i * 4);
     }
+    for (; p < end; p += stride) {
+        __builtin_prefetch(p + stride);
+        for (i = 0; i < 4; i++) {
+            uint32x4_t v = vreinterpretq_u32_u8(vld1q_u8(p + i * 16));
+            acc[i] = vmlaq_u32(acc[i], v, prime2);
+            acc[i] = vsriq_n_u32(vshlq_n_u32(acc[i], 13), acc[i], 19);
+            acc[i] = vmulq_u32(acc[i], prime1);
+        }
+    }
+    for (i = 0; i < 4; i++) {
+        vst1q_u32(lanes + i * 4, acc[i]);
+    }
+#elif defined(__AVX2__)
+    const __m256i prime1 = _mm256_set1_epi32((int)FINGERPRINT_PRIME1);
+    const __m256i prime2 = _mm256_set1_epi32((int)FINGERPRINT_PRIME2);
+    __m256i acc[2];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        acc[i] = _mm256_loadu_si256((const __m256i *)(lanes + i * 8));
+    }
+    for (; p < end; p += stride) {
+        for (i = 0; i < 2; i++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i * 32));
+            acc[i] = _mm256_add_epi32(acc[i], _mm256_mullo_epi32(v, prime2));
+            acc[i] = _mm256_or_si256(_mm256_slli_epi32(acc[i], 13),
+                                     _mm256_srli_epi32(acc[i], 19));
+            acc[i] = _mm256_mullo_epi32(acc[i], prime1);
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        _mm256_storeu_si256((__m256i *)(lanes + i * 8), acc[i]);
+    }
+#elif defined(__SSE4_1__)
+    const __m128i prime1 = _mm_set1_epi32((int)FINGERPRINT_PRIME1);
+    const __m128i prime2 = _mm_set1_epi32((int)FINGERPRINT_PRIME2);
+    __m128i acc[4];
+    int i;
 
-    if (close(fd) == -1) {
-        print_error("close failed");
+    for (i = 0; i < 4; i++) {
+        acc[i] = _mm_loadu_si128((const __m128i *)(lanes + i * 4));
+    }
+    for (; p < end; p += stride) {
+        for (i = 0; i < 4; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 16));
+            acc[i] = _mm_add_epi32(acc[i], _mm_mullo_epi32(v, prime2));
+            acc[i] = _mm_or_si128(_mm_slli_epi32(acc[i], 13),
+                                  _mm_srli_epi32(acc[i], 19));
+            acc[i] = _mm_mullo_epi32(acc[i], prime1);
+        }
+    }
+    for (i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i *)(lanes + i * 4), acc[i]);
+    }
+#else
+    unsigned int word;
+    int i;
+
+    for (; p < end; p += stride) {
+        for (i = 0; i < FINGERPRINT_LANES; i++) {
+            word = p[i * 4] | p[i * 4 + 1] << 8 | p[i * 4 + 2] << 16
+                   | (unsigned int)p[i * 4 + 3] << 24;
+            lanes[i] = rotl32(lanes[i] + word * FINGERPRINT_PRIME2, 13)
+                       * FINGERPRINT_PRIME1;
+        }
     }
+#endif
+}
 
-    return NULL;
+static unsigned int fingerprint_lanes_final(
+        const unsigned int lanes[FINGERPRINT_LANES])
+{
+    unsigned int h = 0;
+    int i;
+
+    for (i = 0; i < FINGERPRINT_LANES; i++) {
+        h = rotl32(h ^ lanes[i], 7) * FINGERPRINT_PRIME1;
+    }
+    h ^= h >> 15;
+    h *= FINGERPRINT_PRIME2;
+    h ^= h >> 13;
+    h *= FINGERPRINT_PRIME3;
+    h ^= h >> 16;
+
+    return h;
 }
 
-static int s_xwin_fps;
-static void *start_xwin_capture(StreamerData *data)
+static unsigned int fingerprint(const void *p, size_t size, size_t stride)
 {
-    int client_fd = data->client_fd;
-    s_xwin_fps = data->fps;
+    unsigned int lanes[FINGERPRINT_LANES];
 
-    long long start_time, end_time, time_diff;
-    long long frame_time = 1000ll / (long)s_xwin_fps;
-#ifdef DEBUG
-    long long capture_start_time, capture_end_time;
-#endif
-    int count, skip_count;
+    fingerprint_lanes_init(lanes);
+    fingerprint_lanes_update(lanes, p, size, stride);
+    return fingerprint_lanes_final(lanes);
+}
 
-    FILE *xwd_out;
-    unsigned char buf[XWIN_BUF_SIZE];
-    size_t skip_size, read_size, offset;
-    ssize_t write_size;
-    int hashs[XWIN_NUM_SEGMENTS] = {0,};
-    int hash, hash_index;;
+// Live view noise changes the hash of almost every frame, so a frame is
+// only published if the luma of one of its tiles moved by more than the
+// threshold on average from the last published frame, or if the last one
+// is older than the refresh interval. Every VIDEO_CHANGE_ROW_STEP-th luma
+// row is compared, the rows of the last frame are kept in a grid.
+// Executor commands "vthreshold=0..255" (0 disables) and
+// "vrefresh=0..60000" (ms).
+#define VIDEO_CHANGE_THRESHOLD 4
+#define VIDEO_CHANGE_THRESHOLD_MAX 255
+#define VIDEO_CHANGE_REFRESH_MS 1000
+#define VIDEO_CHANGE_REFRESH_MAX_MS 60000
+#define VIDEO_CHANGE_ROW_STEP 4
+#define VIDEO_CHANGE_TILE_SIZE 16 // one vector
+#define VIDEO_CHANGE_TILES_X (FRAME_WIDTH / VIDEO_CHANGE_TILE_SIZE)
+#define VIDEO_CHANGE_GRID_SIZE (FRAME_WIDTH * FRAME_HEIGHT \
+                                / VIDEO_CHANGE_ROW_STEP)
+
+static int s_video_change_threshold = VIDEO_CHANGE_THRESHOLD;
+static int s_video_refresh_ms = VIDEO_CHANGE_REFRESH_MS;
+
+// Adds the sum of absolute differences of each tile of a row to sums[].
+static void sad_row_tiles(const unsigned char *a, const unsigned char *b,
+                          int width, unsigned int *sums)
+{
+    int x = 0;
 
-    bool err = false;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; x + VIDEO_CHANGE_TILE_SIZE <= width; x += VIDEO_CHANGE_TILE_SIZE) {
+        uint8x16_t diff = vabdq_u8(vld1q_u8(a + x), vld1q_u8(b + x));
+        uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(diff)));
 
-    free(data);
+        sums[x / VIDEO_CHANGE_TILE_SIZE] += vgetq_lane_u64(sum, 0)
+                                            + vgetq_lane_u64(sum, 1);
+    }
+#elif defined(__SSE2__)
+    for (; x + VIDEO_CHANGE_TILE_SIZE <= width; x += VIDEO_CHANGE_TILE_SIZE) {
+        __m128i sum = _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + x)),
+                                   _mm_loadu_si128((const __m128i *)(b + x)));
 
-#ifdef DEBUG
-    capture_start_time = get_current_time();
+        sums[x / VIDEO_CHANGE_TILE_SIZE] += _mm_cvtsi128_si32(sum)
+                                            + _mm_extract_epi16(sum, 4);
+    }
 #endif
-    count = 0;
-    while (true) {
-        start_time = get_current_time();
-        hash = 0;
-        err = false;
+    for (; x < width; x++) {
+        sums[x / VIDEO_CHANGE_TILE_SIZE] += abs(a[x] - b[x]);
+    }
+}
 
-        xwd_out = popen("xwd -root", "r");
-        if (xwd_out == NULL) {
-            print_error("popen() failed");
-            continue;
+// Compares the luma of frame with grid, the sampled rows of the last
+// published frame.
+static bool luma_changed(const unsigned char *frame, const unsigned char *grid,
+                         int threshold)
+{
+    const unsigned int limit = threshold * VIDEO_CHANGE_TILE_SIZE
+                               * (VIDEO_CHANGE_TILE_SIZE
+                                  / VIDEO_CHANGE_ROW_STEP);
+    unsigned int sums[VIDEO_CHANGE_TILES_X];
+    int x, y, tile_y;
+
+    for (tile_y = 0; tile_y < FRAME_HEIGHT;
+         tile_y += VIDEO_CHANGE_TILE_SIZE) {
+        memset(sums, 0, sizeof(sums));
+        for (y = tile_y; y < tile_y + VIDEO_CHANGE_TILE_SIZE;
+             y += VIDEO_CHANGE_ROW_STEP) {
+            sad_row_tiles(frame + y * FRAME_WIDTH,
+                          grid + y / VIDEO_CHANGE_ROW_STEP * FRAME_WIDTH,
+                          FRAME_WIDTH, sums);
         }
-
-        skip_size = XWD_SKIP_BYTES;
-        do {
-            read_size = fread(buf, 1, skip_size < XWIN_BUF_SIZE
-                                        ? skip_size : XWIN_BUF_SIZE,
-                              xwd_out);
-            if (read_size == 0) {
-                err = true;
-                log("xwd read_size = 0");
-                break;
+        for (x = 0; x < VIDEO_CHANGE_TILES_X; x++) {
+            if (sums[x] > limit) {
+                return true;
             }
-            skip_size -= read_size;
-        } while (skip_size != 0);
-
-        if (err) {
-            pclose(xwd_out);
-            continue;
         }
+    }
 
-        if (skip_size == 0) {
-            offset = 0;
-            hash_index = 0;
-            skip_count = 0;
-            while (true) {
-                read_size = fread(buf + 2, 1, XWIN_BUF_SIZE - 2, xwd_out); // first 2 bytes is index
-                offset += read_size;
-                if (read_size == 0) {
-                    log("read_size == 0");
-                    err = true;
-                    break;
-                } else if (read_size != XWIN_BUF_SIZE - 2) {
-                    log("read_size != %d (XWIN_BUF_SIZE)", XWIN_BUF_SIZE);
-                    err = true;
-                    break;
-                } else {
-                    int i;
-                    for (i = 2; i < read_size + 2; i += 4) {
-                        hash += buf[i];
-                        if (buf[i] > 0) {
-                            hash += i;
-                        }
-                    }
+    return false;
+}
 
-                    if (hash_index != 0 && hashs[hash_index] == hash) {
-                        skip_count++;
-                    } else {
-                        hashs[hash_index] = hash;
-                        buf[0] = (hash_index >> 8) & 0xff;
-                        buf[1] = hash_index & 0xff;
-
-                        write_size = write(client_fd, buf, XWIN_BUF_SIZE);
-                        if (write_size != XWIN_BUF_SIZE) {
-                            log("write() failed");
-                            err = true;
-                            break;
-                        }
-                    }
-                    if (offset == XWIN_FRAME_SIZE) {
-                        // notify end of frame
-                        buf[0] = 0x0f;
-                        buf[1] = 0xff;
-                        write_size = write(client_fd, buf, XWIN_BUF_SIZE);
-                        if (write_size != XWIN_BUF_SIZE) {
-                            log("write() failed");
-                            err = true;
-                            break;
-                        }
-
-                        if (skip_count != 1080 - 1) {
-                            log("[XWinCapture] count = %d, skip_count = %d",
-                                count, skip_count);
-                        }
-                        break;
-                    }
-                }
-                hash_index++;
-            }
-        } else {
-            log("skip_size = %d", skip_size);
-            err = true;
-        }
+static void update_luma_grid(unsigned char *grid, const unsigned char *frame)
+{
+    int y;
 
-        if (pclose(xwd_out) == -1) {
-            //print_error("pclose() failed");
-            //err = true;
-        }
+    for (y = 0; y < FRAME_HEIGHT; y += VIDEO_CHANGE_ROW_STEP) {
+        memcpy(grid + y / VIDEO_CHANGE_ROW_STEP * FRAME_WIDTH,
+               frame + y * FRAME_WIDTH, FRAME_WIDTH);
+    }
+}
 
-        end_time = get_current_time();
+// The LCD buffers are mapped uncached from /dev/mem, where every load is a
+// separate bus access. Frames are staged into cached memory with the widest
+// loads available before they are hashed or sent. The fastest copier is
+// picked by calibrate_staging_copy() on the real mapping.
+#define STAGING_ALIGN 64
+#define STAGING_CALIBRATION_ROUNDS 3
 
-        time_diff = end_time - start_time;
-        if (time_diff < frame_time) {
-            //log("sleep %lld ms", frame_time - time_diff);
-            usleep((frame_time - time_diff) * 1000);
-        }
-        count++;
-        frame_time = 1000ll / (long)s_xwin_fps;
+typedef void (*StagingCopyFunc)(void *dst, const void *src, size_t size);
 
-        if (err) {
-            break;
-        }
+typedef struct {
+    const char *name;
+    StagingCopyFunc copy;
+} StagingCopier;
+
+static void staging_copy_memcpy(void *dst, const void *src, size_t size)
+{
+    memcpy(dst, src, size);
+}
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+// 64 bytes per iteration, one burst per vld1 of four q registers
+static void staging_copy_neon64(void *dst, const void *src, size_t size)
+{
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    const unsigned char *end = s + (size & ~(size_t)63);
+    uint8x16_t q0, q1, q2, q3;
+
+    for (; s < end; s += 64, d += 64) {
+        q0 = vld1q_u8(s);
+        q1 = vld1q_u8(s + 16);
+        q2 = vld1q_u8(s + 32);
+        q3 = vld1q_u8(s + 48);
+        vst1q_u8(d, q0);
+        vst1q_u8(d + 16, q1);
+        vst1q_u8(d + 32, q2);
+        vst1q_u8(d + 48, q3);
     }
-#ifdef DEBUG
-    capture_end_time = get_current_time();
-    log("time = %f", (capture_end_time - capture_start_time) / 1000.0);
-#endif
+    memcpy(d, s, size & 63);
+}
 
-    return NULL;
+// 128 bytes per iteration, more loads in flight before the first store
+static void staging_copy_neon128(void *dst, const void *src, size_t size)
+{
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    const unsigned char *end = s + (size & ~(size_t)127);
+    uint8x16_t q0, q1, q2, q3, q4, q5, q6, q7;
+
+    for (; s < end; s += 128, d += 128) {
+        q0 = vld1q_u8(s);
+        q1 = vld1q_u8(s + 16);
+        q2 = vld1q_u8(s + 32);
+        q3 = vld1q_u8(s + 48);
+        q4 = vld1q_u8(s + 64);
+        q5 = vld1q_u8(s + 80);
+        q6 = vld1q_u8(s + 96);
+        q7 = vld1q_u8(s + 112);
+        vst1q_u8(d, q0);
+        vst1q_u8(d + 16, q1);
+        vst1q_u8(d + 32, q2);
+        vst1q_u8(d + 48, q3);
+        vst1q_u8(d + 64, q4);
+        vst1q_u8(d + 80, q5);
+        vst1q_u8(d + 96, q6);
+        vst1q_u8(d + 112, q7);
+    }
+    memcpy(d, s, size & 127);
 }
+#endif
 
-static void run_command(char *command_line)
+static const StagingCopier s_staging_copiers[] = {
+    { "memcpy", staging_copy_memcpy },
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    { "neon64", staging_copy_neon64 },
+    { "neon128", staging_copy_neon128 },
+#endif
+};
+
+#define NUM_STAGING_COPIERS \
+        (sizeof(s_staging_copiers) / sizeof(s_staging_copiers[0]))
+
+static const StagingCopier *s_staging_copier = &s_staging_copiers[0];
+
+static void *alloc_frame_buffer(size_t size)
 {
-    pid_t pid = fork();
-    if (pid == 0) { // child
-        log("execvp(), %s", command_line);
-#define MAX_ARGS 63
-        int argc = 0;
-        char *argv[MAX_ARGS + 1];
-        char *p = strtok(command_line, " ");
-        while (p && argc < MAX_ARGS) {
-            argv[argc++] = p;
-            p = strtok(NULL, " ");
-        }
-        argv[argc] = NULL;
-        execvp(argv[0], argv);
-    } else if (pid > 0) {
-        // parent. do nothing
-    } else {
-        print_error("fork() failed!");
+    void *p;
+
+    if (posix_memalign(&p, STAGING_ALIGN, size) != 0) {
+        return NULL;
     }
+    return p;
 }
 
-static void *start_executor(StreamerData *data)
+static unsigned char *put_u16(unsigned char *p, unsigned int value)
+{
+    p[0] = (value >> 8) & 0xff;
+    p[1] = value & 0xff;
+    return p + 2;
+}
+
+static unsigned char *put_u32(unsigned char *p, unsigned int value)
+{
+    p[0] = (value >> 24) & 0xff;
+    p[1] = (value >> 16) & 0xff;
+    p[2] = (value >> 8) & 0xff;
+    p[3] = value & 0xff;
+    return p + 4;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+    const unsigned char *p = buf;
+    ssize_t write_size;
+
+    while (size > 0) {
+        write_size = write(fd, p, size);
+        if (write_size == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += write_size;
+        size -= write_size;
+    }
+
+    return 0;
+}
+
+typedef struct {
+    int mode;
+    int send_method;
+    int scale;  // 1, 2, 4 or 8, used when width is 0
+    int width;  // requested output size, 0 = crop size / scale
+    int height;
+    int crop_x; // crop rectangle, crop_width 0 = whole frame
+    int crop_y;
+    int crop_width;
+    int crop_height;
+    int jpeg_quality;
+    int jpeg_subsampling; // 420, 422 or 444
+    int fps_min; // adaptive frame rate if fps_max is set
+    int fps_max;
+    int udp_port; // 0 = TCP
+    bool peaking;
+    int peaking_threshold;
+} VideoOptions;
+
+static void video_options_init(VideoOptions *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->mode = VIDEO_MODE_RAW;
+    options->send_method = VIDEO_SEND_WRITE;
+    options->scale = 1;
+    options->jpeg_quality = VIDEO_JPEG_QUALITY;
+    options->jpeg_subsampling = VIDEO_JPEG_SUBSAMPLING;
+    options->peaking_threshold = VIDEO_PEAKING_THRESHOLD;
+}
+
+typedef struct {
+    char buf[VIDEO_OPTION_LINE_MAX];
+    size_t len;
+} OptionReader;
+
+typedef void (*ParseOptionFunc)(void *arg, const char *line);
+
+static void parse_video_option(VideoOptions *options, const char *line,
+                               bool mode_locked)
+{
+    if (strncmp("mode=", line, 5) == 0) {
+        int mode;
+
+        if (strcmp(line + 5, "raw") == 0) {
+            mode = VIDEO_MODE_RAW;
+        } else if (strcmp(line + 5, "tile") == 0) {
+            mode = VIDEO_MODE_TILE;
+        } else if (strcmp(line + 5, "frame") == 0) {
+            mode = VIDEO_MODE_FRAME;
+        } else if (strcmp(line + 5, "progressive") == 0) {
+            mode = VIDEO_MODE_PROGRESSIVE;
+#ifdef USE_LIBJPEG
+        } else if (strcmp(line + 5, "jpeg") == 0) {
+            mode = VIDEO_MODE_JPEG;
+#endif
+        } else {
+            log("unknown video mode = %s", line + 5);
+            return;
+        }
+        if (mode_locked) {
+            log("video mode can't be changed after the first frame.");
+            return;
+        }
+        options->mode = mode;
+    } else if (strcmp("send=write", line) == 0) {
+        options->send_method = VIDEO_SEND_WRITE;
+    } else if (strcmp("send=splice", line) == 0) {
+        options->send_method = VIDEO_SEND_SPLICE;
+    } else if (strcmp("peaking=on", line) == 0) {
+        options->peaking = true;
+    } else if (strcmp("peaking=off", line) == 0) {
+        options->peaking = false;
+    } else if (strncmp("peaking_threshold=", line, 18) == 0) {
+        int threshold = atoi(line + 18);
+
+        if (threshold >= 1) {
+            options->peaking_threshold =
+                    threshold < VIDEO_PEAKING_THRESHOLD_MAX ?
+                    threshold : VIDEO_PEAKING_THRESHOLD_MAX;
+        }
+    } else if (strcmp("transport=tcp", line) == 0) {
+        options->udp_port = 0;
+    } else if (strncmp("transport=udp:", line, 14) == 0) {
+        int port = atoi(line + 14);
+
+        if (port > 0 && port <= 0xffff) {
+            options->udp_port = port;
+        } else {
+            log("invalid udp port = %s", line + 14);
+        }
+    } else if (strncmp("scale=", line, 6) == 0) {
+        int scale = atoi(line + 6);
+
+        if (scale == 1 || scale == 2 || scale == 4 || scale == 8) {
+            options->scale = scale;
+            options->width = options->height = 0;
+        } else {
+            log("unsupported video scale = %s", line + 6);
+        }
+    } else if (strncmp("size=", line, 5) == 0) {
+        if (sscanf(line + 5, "%dx%d", &options->width,
+                   &options->height) != 2 ||
+            options->width < 2 || options->height < 2) {
+            options->width = options->height = 0;
+        }
+    } else if (strncmp("fps_min=", line, 8) == 0) {
+        options->fps_min = atoi(line + 8);
+    } else if (strncmp("fps_max=", line, 8) == 0) {
+        options->fps_max = atoi(line + 8);
+    } else if (strncmp("quality=", line, 8) == 0) {
+        int quality = atoi(line + 8);
+
+        if (quality >= 1 && quality <= 100) {
+            options->jpeg_quality = quality;
+        }
+    } else if (strncmp("subsampling=", line, 12) == 0) {
+        int subsampling = atoi(line + 12);
+
+        if (subsampling == 420 || subsampling == 422 || subsampling == 444) {
+            options->jpeg_subsampling = subsampling;
+        } else {
+            log("unsupported subsampling = %s", line + 12);
+        }
+    } else if (strncmp("crop=", line, 5) == 0) {
+        if (sscanf(line + 5, "%d,%d,%d,%d", &options->crop_x,
+                   &options->crop_y, &options->crop_width,
+                   &options->crop_height) != 4 ||
+            options->crop_x < 0 || options->crop_y < 0 ||
+            options->crop_width < 2 || options->crop_height < 2) {
+            // "crop=off"
+            options->crop_width = options->crop_height = 0;
+        }
+    } else {
+        log("unknown video option = %s", line);
+    }
+}
+
+// Reads "key=value\n" lines sent by the client and passes each to parse.
+// Returns false if the client closed the connection.
+static bool read_option_lines(int client_fd, OptionReader *reader,
+                              int timeout_ms, ParseOptionFunc parse,
+                              void *arg)
+{
+    struct pollfd pfd;
+    ssize_t read_size;
+    char *eol;
+
+    pfd.fd = client_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return true;
+    }
+
+    read_size = recv(client_fd, reader->buf + reader->len,
+                     sizeof(reader->buf) - reader->len - 1, MSG_DONTWAIT);
+    if (read_size == 0) {
+        return false;
+    } else if (read_size == -1) {
+        return errno == EWOULDBLOCK || errno == EINTR;
+    }
+    reader->len += read_size;
+    reader->buf[reader->len] = '\0';
+
+    while ((eol = strchr(reader->buf, '\n')) != NULL) {
+        *eol = '\0';
+        if (eol > reader->buf && eol[-1] == '\r') {
+            eol[-1] = '\0';
+        }
+        parse(arg, reader->buf);
+        reader->len -= eol + 1 - reader->buf;
+        memmove(reader->buf, eol + 1, reader->len + 1);
+    }
+    if (reader->len == sizeof(reader->buf) - 1) {
+        log("option line too long.");
+        reader->len = 0;
+    }
+
+    return true;
+}
+
+typedef struct {
+    VideoOptions *options;
+    bool mode_locked;
+} VideoOptionTarget;
+
+static void parse_video_option_line(void *arg, const char *line)
+{
+    VideoOptionTarget *target = (VideoOptionTarget *)arg;
+
+    parse_video_option(target->options, line, target->mode_locked);
+}
+
+// Reads the options sent by the client on the video socket. Old clients
+// never write to this socket, so they always get the defaults.
+// Returns false if the client closed the connection.
+static bool read_video_options(int client_fd, OptionReader *reader,
+                               VideoOptions *options, int timeout_ms,
+                               bool mode_locked)
+{
+    VideoOptionTarget target = { options, mode_locked };
+
+    return read_option_lines(client_fd, reader, timeout_ms,
+                             parse_video_option_line, &target);
+}
+
+typedef struct {
+    unsigned char *data; // NV12, VIDEO_FRAME_SIZE bytes
+    int width;           // active area, packed at the start of data
+    int height;
+    unsigned int seq;
+    long long timestamp; // us, CLOCK_MONOTONIC
+    int buffer_index;    // index of s_addrs
+    int refs;            // FrameHub references
+    bool luma_only;      // the UV plane is stale, see frame_hub_luma_only()
+} VideoFrame;
+
+static unsigned char *put_video_msg_header(unsigned char *p, int type,
+                                           const VideoFrame *frame,
+                                           int width, int height, int count,
+                                           size_t payload_size)
+{
+    p = put_u32(p, VIDEO_MSG_MAGIC);
+    *p++ = type;
+    *p++ = frame->buffer_index;
+    p = put_u16(p, count);
+    p = put_u32(p, frame->seq);
+    p = put_u32(p, (unsigned long long)frame->timestamp >> 32);
+    p = put_u32(p, frame->timestamp & 0xffffffff);
+    p = put_u16(p, width);
+    p = put_u16(p, height);
+    p = put_u32(p, payload_size);
+    return p;
+}
+
+// NV12 picture: width x height luma followed by width x height/2 of
+// interleaved UV, both planes with stride bytes per row
+typedef struct {
+    unsigned char *y;
+    unsigned char *uv;
+    int width;
+    int height;
+    int stride;
+} Nv12Image;
+
+static void nv12_image_init(Nv12Image *image, unsigned char *data,
+                            int width, int height)
+{
+    image->y = data;
+    image->uv = data + width * height;
+    image->width = width;
+    image->height = height;
+    image->stride = width;
+}
+
+static size_t nv12_image_size(const Nv12Image *image)
+{
+    return image->width * image->height * 3 / 2;
+}
+
+// Compares each tile of image with shadow (the last sent image, packed) and
+// packs the changed ones into buf as a VIDEO_MSG_TILES message. shadow is
+// updated with the packed tiles. Returns the message size, or 0 if nothing
+// changed.
+static size_t encode_video_tiles(const VideoFrame *frame,
+                                 const Nv12Image *image,
+                                 unsigned char *shadow, unsigned char *buf,
+                                 bool force)
+{
+    const int width = image->width;
+    const int height = image->height;
+    unsigned char *shadow_uv = shadow + width * height;
+    unsigned char *p = buf + VIDEO_MSG_HEADER_SIZE;
+    int count = 0;
+    int x, y, tw, th, row;
+
+    for (y = 0; y < height; y += VIDEO_TILE_SIZE) {
+        th = height - y < VIDEO_TILE_SIZE ? height - y : VIDEO_TILE_SIZE;
+        for (x = 0; x < width; x += VIDEO_TILE_SIZE) {
+            const unsigned char *src_y = image->y + y * image->stride + x;
+            const unsigned char *src_uv = image->uv + y / 2 * image->stride + x;
+            unsigned char *dst_y = shadow + y * width + x;
+            unsigned char *dst_uv = shadow_uv + y / 2 * width + x;
+            bool changed = force;
+
+            tw = width - x < VIDEO_TILE_SIZE ? width - x : VIDEO_TILE_SIZE;
+            for (row = 0; !changed && row < th; row++) {
+                changed = memcmp(src_y + row * image->stride,
+                                 dst_y + row * width, tw) != 0;
+            }
+            for (row = 0; !changed && row < th / 2; row++) {
+                changed = memcmp(src_uv + row * image->stride,
+                                 dst_uv + row * width, tw) != 0;
+            }
+            if (!changed) {
+                continue;
+            }
+
+            p = put_u16(p, x);
+            p = put_u16(p, y);
+            for (row = 0; row < th; row++) {
+                memcpy(p, src_y + row * image->stride, tw);
+                memcpy(dst_y + row * width, p, tw);
+                p += tw;
+            }
+            for (row = 0; row < th / 2; row++) {
+                memcpy(p, src_uv + row * image->stride, tw);
+                memcpy(dst_uv + row * width, p, tw);
+                p += tw;
+            }
+            count++;
+        }
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    put_video_msg_header(buf, VIDEO_MSG_TILES, frame, width, height, count,
+                         p - buf - VIDEO_MSG_HEADER_SIZE);
+    return p - buf;
+}
+
+// Halves both dimensions with a 2x2 box filter.
+// src->width and src->height must be multiples of 4.
+static void nv12_downscale_half(const Nv12Image *src, Nv12Image *dst)
+{
+    const int width = src->width / 2;
+    const int height = src->height / 2;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        const unsigned char *s0 = src->y + y * 2 * src->stride;
+        const unsigned char *s1 = s0 + src->stride;
+        unsigned char *d = dst->y + y * dst->stride;
+
+        x = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+        for (; x + 16 <= width; x += 16) {
+            uint16x8_t lo = vaddq_u16(vpaddlq_u8(vld1q_u8(s0 + x * 2)),
+                                      vpaddlq_u8(vld1q_u8(s1 + x * 2)));
+            uint16x8_t hi = vaddq_u16(vpaddlq_u8(vld1q_u8(s0 + x * 2 + 16)),
+                                      vpaddlq_u8(vld1q_u8(s1 + x * 2 + 16)));
+            vst1q_u8(d + x, vcombine_u8(vrshrn_n_u16(lo, 2),
+                                        vrshrn_n_u16(hi, 2)));
+        }
+#endif
+        for (; x < width; x++) {
+            d[x] = (s0[x * 2] + s0[x * 2 + 1] + s1[x * 2] + s1[x * 2 + 1]
+                    + 2) >> 2;
+        }
+    }
+
+    // chroma is width/2 x height/2 UV pairs
+    for (y = 0; y < height / 2; y++) {
+        const unsigned char *s0 = src->uv + y * 2 * src->stride;
+        const unsigned char *s1 = s0 + src->stride;
+        unsigned char *d = dst->uv + y * dst->stride;
+
+        x = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+        for (; x + 16 <= width; x += 16) {
+            uint8x16x2_t r0 = vld2q_u8(s0 + x * 2);
+            uint8x16x2_t r1 = vld2q_u8(s1 + x * 2);
+            uint8x8x2_t uv;
+
+            uv.val[0] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(r0.val[0]),
+                                               vpaddlq_u8(r1.val[0])), 2);
+            uv.val[1] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(r0.val[1]),
+                                               vpaddlq_u8(r1.val[1])), 2);
+            vst2_u8(d + x, uv);
+        }
+#endif
+        for (; x < width; x += 2) {
+            d[x] = (s0[x * 2] + s0[x * 2 + 2] + s1[x * 2] + s1[x * 2 + 2]
+                    + 2) >> 2;
+            d[x + 1] = (s0[x * 2 + 1] + s0[x * 2 + 3] + s1[x * 2 + 1]
+                        + s1[x * 2 + 3] + 2) >> 2;
+        }
+    }
+
+    dst->width = width;
+    dst->height = height;
+}
+
+// Averages one plane over the source box of every destination sample.
+// channels is 1 for luma and 2 for interleaved UV.
+static void downscale_plane_box(const unsigned char *src, int src_width,
+                                int src_height, int src_stride,
+                                unsigned char *dst, int dst_width,
+                                int dst_height, int dst_stride, int channels)
+{
+    int x, y, sx, sy, c;
+
+    for (y = 0; y < dst_height; y++) {
+        const int y0 = y * src_height / dst_height;
+        int y1 = (y + 1) * src_height / dst_height;
+
+        if (y1 <= y0) {
+            y1 = y0 + 1;
+        }
+        for (x = 0; x < dst_width; x++) {
+            const int x0 = x * src_width / dst_width;
+            int x1 = (x + 1) * src_width / dst_width;
+            int area;
+
+            if (x1 <= x0) {
+                x1 = x0 + 1;
+            }
+            area = (y1 - y0) * (x1 - x0);
+            for (c = 0; c < channels; c++) {
+                unsigned int sum = 0;
+
+                for (sy = y0; sy < y1; sy++) {
+                    const unsigned char *s = src + sy * src_stride + c;
+                    for (sx = x0; sx < x1; sx++) {
+                        sum += s[sx * channels];
+                    }
+                }
+                dst[y * dst_stride + x * channels + c] = (sum + area / 2)
+                                                         / area;
+            }
+        }
+    }
+}
+
+static void nv12_downscale_box(const Nv12Image *src, Nv12Image *dst,
+                               int width, int height)
+{
+    downscale_plane_box(src->y, src->width, src->height, src->stride,
+                        dst->y, width, height, dst->stride, 1);
+    downscale_plane_box(src->uv, src->width / 2, src->height / 2, src->stride,
+                        dst->uv, width / 2, height / 2, dst->stride, 2);
+    dst->width = width;
+    dst->height = height;
+}
+
+static void nv12_copy(const Nv12Image *src, Nv12Image *dst)
+{
+    int y;
+
+    for (y = 0; y < src->height; y++) {
+        memcpy(dst->y + y * dst->stride, src->y + y * src->stride,
+               src->width);
+    }
+    for (y = 0; y < src->height / 2; y++) {
+        memcpy(dst->uv + y * dst->stride, src->uv + y * src->stride,
+               src->width);
+    }
+    dst->width = src->width;
+    dst->height = src->height;
+}
+
+// Sets mask[x] to 0xff where the luma gradient of row is above threshold,
+// for 1 <= x < width - 1. stride is the distance to the next row.
+static void peaking_row(const unsigned char *row, int stride, int width,
+                        int threshold, unsigned char *mask)
+{
+    const unsigned char *up = row - stride;
+    const unsigned char *down = row + stride;
+    int x = 1;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    const uint8x16_t threshold_v = vdupq_n_u8(threshold);
+
+    for (; x + 16 <= width - 1; x += 16) {
+        uint8x16_t dx = vabdq_u8(vld1q_u8(row + x + 1),
+                                 vld1q_u8(row + x - 1));
+        uint8x16_t dy = vabdq_u8(vld1q_u8(down + x), vld1q_u8(up + x));
+
+        vst1q_u8(mask + x, vcgtq_u8(vqaddq_u8(dx, dy), threshold_v));
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8((char)0xff);
+    const __m128i threshold_v = _mm_set1_epi8((char)threshold);
+
+    for (; x + 16 <= width - 1; x += 16) {
+        __m128i left = _mm_loadu_si128((const __m128i *)(row + x - 1));
+        __m128i right = _mm_loadu_si128((const __m128i *)(row + x + 1));
+        __m128i top = _mm_loadu_si128((const __m128i *)(up + x));
+        __m128i bottom = _mm_loadu_si128((const __m128i *)(down + x));
+        __m128i dx = _mm_or_si128(_mm_subs_epu8(left, right),
+                                  _mm_subs_epu8(right, left));
+        __m128i dy = _mm_or_si128(_mm_subs_epu8(top, bottom),
+                                  _mm_subs_epu8(bottom, top));
+        __m128i over = _mm_subs_epu8(_mm_adds_epu8(dx, dy), threshold_v);
+
+        _mm_storeu_si128((__m128i *)(mask + x),
+                         _mm_xor_si128(_mm_cmpeq_epi8(over, zero), ones));
+    }
+#endif
+    for (; x < width - 1; x++) {
+        int g = abs(row[x + 1] - row[x - 1]) + abs(down[x] - up[x]);
+
+        mask[x] = g > threshold ? 0xff : 0;
+    }
+}
+
+static unsigned char *put_varint(unsigned char *p, unsigned int value)
+{
+    while (value >= 0x80) {
+        *p++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+// Packs the VIDEO_MSG_PEAKING payload of the luma of image into buf, with
+// row_buf as a scratch row of image->width bytes. Returns the size.
+static size_t encode_peaking_mask(const Nv12Image *image, int threshold,
+                                  unsigned char *row_buf, unsigned char *buf)
+{
+    unsigned char *p = buf;
+    unsigned char state = 0; // of the current run
+    unsigned int run = 0;
+    unsigned long long word;
+    int x, y;
+
+    for (y = 0; y < image->height; y++) {
+        memset(row_buf, 0, image->width);
+        if (y != 0 && y != image->height - 1) {
+            peaking_row(image->y + y * image->stride, image->stride,
+                        image->width, threshold, row_buf);
+        }
+
+        for (x = 0; x < image->width; ) {
+            // most of the mask is long runs, skip them a word at a time
+            if (x + 8 <= image->width) {
+                memcpy(&word, row_buf + x, sizeof(word));
+                if (word == (state ? ~0ULL : 0)) {
+                    run += 8;
+                    x += 8;
+                    continue;
+                }
+            }
+            if (row_buf[x] != state) {
+                p = put_varint(p, run);
+                state = row_buf[x];
+                run = 0;
+            }
+            run++;
+            x++;
+        }
+    }
+    p = put_varint(p, run);
+
+    return p - buf;
+}
+
+static const int s_video_layer_uv[VIDEO_LAYERS] = { 0, 1, 0, 1, 0, 1, 0 };
+static const int s_video_layer_steps[VIDEO_LAYERS] = { 8, 4, 4, 2, 2, 1, 1 };
+
+// Packs one VIDEO_MSG_LAYER layer of image into buf. Returns the size.
+static size_t pack_video_layer(const Nv12Image *image, int layer,
+                               unsigned char *buf)
+{
+    const bool uv = s_video_layer_uv[layer];
+    const int step = s_video_layer_steps[layer];
+    const unsigned char *plane = uv ? image->uv : image->y;
+    const int width = uv ? image->width / 2 : image->width;
+    const int height = uv ? image->height / 2 : image->height;
+    const unsigned char *row;
+    unsigned char *p = buf;
+    int x, y, x_start, x_step;
+
+    for (y = 0; y < height; y += step) {
+        row = plane + y * image->stride;
+        x_start = 0;
+        x_step = step;
+        if (layer >= 2 && y % (step * 2) == 0) {
+            x_start = step;
+            x_step = step * 2;
+        }
+
+        if (x_step == 1) {
+            memcpy(p, row, uv ? width * 2 : width);
+            p += uv ? width * 2 : width;
+        } else if (uv) {
+            for (x = x_start; x < width; x += x_step) {
+                *p++ = row[x * 2];
+                *p++ = row[x * 2 + 1];
+            }
+        } else {
+            for (x = x_start; x < width; x += x_step) {
+                *p++ = row[x];
+            }
+        }
+    }
+
+    return p - buf;
+}
+
+typedef struct {
+    unsigned long captured;
+    unsigned long sent;
+    unsigned long dropped;
+    unsigned long long write_bytes;
+    unsigned long long write_cpu_us;
+    unsigned long long splice_bytes;
+    unsigned long long splice_cpu_us;
+    unsigned long long staging_bytes;
+    unsigned long long staging_us;
+    unsigned long jpeg_frames;
+    unsigned long long jpeg_bytes;
+    unsigned long long jpeg_encode_us;
+    unsigned long static_skipped; // within the noise threshold
+    unsigned long long change_detect_us;
+    unsigned long layers;    // VIDEO_MODE_PROGRESSIVE
+    unsigned long preempted; // frames with layers left for a newer one
+    unsigned long udp_datagrams;
+    unsigned long long udp_bytes;
+    unsigned long udp_cut; // messages not sent in full, ENOBUFS
+    unsigned long peaking_masks;
+    unsigned long long peaking_bytes;
+    unsigned long long peaking_us;
+    unsigned long torn;         // copies changed by the LCD writer meanwhile
+    unsigned long torn_skipped; // buffers left for the next tick
+    unsigned long long tear_check_us;
+} VideoStats;
+
+static VideoStats s_video_stats;
+
+// Fans the frames of one producer thread out to up to
+// FRAME_HUB_MAX_SUBSCRIBERS connections. Each subscriber has its own queue
+// of FRAME_QUEUE_SIZE frames and publishing to a full queue drops the oldest
+// one, so a slow subscriber never blocks the producer or the others. Frames
+// are refcounted and go back to the pool when the last reference is gone.
+#define FRAME_HUB_MAX_SUBSCRIBERS 4
+#define FRAME_QUEUE_SIZE 2
+// every subscriber holds its queue and the frame being sent, the producer
+// fills one more
+#define FRAME_POOL_SIZE (FRAME_HUB_MAX_SUBSCRIBERS * (FRAME_QUEUE_SIZE + 1) + 1)
+
+typedef struct {
+    VideoFrame *frames[FRAME_QUEUE_SIZE];
+    int head;
+    int count;
+    int event_fd; // signaled on every queued frame, -1 if unused
+    int fps;      // adaptive rate of the subscriber, 0 if not adaptive
+    in_addr_t peer_addr;
+    bool luma_only;        // reads the Y plane only
+    volatile bool closing; // see frame_hub_close_peer()
+} FrameQueue;
+
+typedef struct {
+    pthread_mutex_t subscribe_lock; // producer start and stop
+    pthread_mutex_t lock;           // refs and queues
+    size_t frame_size;
+    VideoFrame pool[FRAME_POOL_SIZE];
+    FrameQueue queues[FRAME_HUB_MAX_SUBSCRIBERS];
+    int num_subscribers;
+    bool (*start)(void *owner); // for the first subscriber
+    void (*stop)(void *owner);  // after the last subscriber left
+    void *owner;
+    unsigned long *dropped; // stats counter, may be NULL
+} FrameHub;
+
+static void frame_hub_init(FrameHub *hub, size_t frame_size,
+                           bool (*start)(void *owner),
+                           void (*stop)(void *owner), void *owner,
+                           unsigned long *dropped)
+{
+    int i;
+
+    memset(hub, 0, sizeof(*hub));
+    pthread_mutex_init(&hub->subscribe_lock, NULL);
+    pthread_mutex_init(&hub->lock, NULL);
+    hub->frame_size = frame_size;
+    hub->start = start;
+    hub->stop = stop;
+    hub->owner = owner;
+    hub->dropped = dropped;
+    for (i = 0; i < FRAME_HUB_MAX_SUBSCRIBERS; i++) {
+        hub->queues[i].event_fd = -1;
+    }
+}
+
+// Returns the subscriber index, or -1 if the hub is full or the producer
+// can't be started. peer_addr, fps and luma_only are set under the lock, the
+// producer and frame_hub_close_peer() read them at any time.
+static int frame_hub_subscribe(FrameHub *hub, in_addr_t peer_addr, int fps,
+                               bool luma_only)
+{
+    int index, event_fd;
+
+    pthread_mutex_lock(&hub->subscribe_lock);
+
+    for (index = 0; index < FRAME_HUB_MAX_SUBSCRIBERS; index++) {
+        if (hub->queues[index].event_fd == -1) {
+            break;
+        }
+    }
+    if (index == FRAME_HUB_MAX_SUBSCRIBERS) {
+        log("too many subscribers.");
+        index = -1;
+        goto out;
+    }
+
+    event_fd = eventfd(0, EFD_NONBLOCK);
+    if (event_fd == -1) {
+        print_error("eventfd() failed");
+        index = -1;
+        goto out;
+    }
+
+    if (hub->num_subscribers == 0 && !hub->start(hub->owner)) {
+        close(event_fd);
+        index = -1;
+        goto out;
+    }
+
+    pthread_mutex_lock(&hub->lock);
+    hub->queues[index].head = 0;
+    hub->queues[index].count = 0;
+    hub->queues[index].event_fd = event_fd;
+    hub->queues[index].fps = fps;
+    hub->queues[index].peer_addr = peer_addr;
+    hub->queues[index].luma_only = luma_only;
+    hub->queues[index].closing = false;
+    pthread_mutex_unlock(&hub->lock);
+    hub->num_subscribers++;
+    log("subscribers = %d", hub->num_subscribers);
+
+out:
+    pthread_mutex_unlock(&hub->subscribe_lock);
+    return index;
+}
+
+// Sets *stream_fps to fps if nobody watches the stream yet. A viewer
+// joining a running stream must not undo its vfps/xfps command.
+static void frame_hub_set_start_fps(FrameHub *hub, int *stream_fps, int fps)
+{
+    pthread_mutex_lock(&hub->subscribe_lock);
+    if (hub->num_subscribers == 0) {
+        *stream_fps = fps;
+    }
+    pthread_mutex_unlock(&hub->subscribe_lock);
+}
+
+static void frame_hub_unsubscribe(FrameHub *hub, int index)
+{
+    FrameQueue *queue = &hub->queues[index];
+    int i;
+
+    pthread_mutex_lock(&hub->subscribe_lock);
+
+    pthread_mutex_lock(&hub->lock);
+    for (i = 0; i < queue->count; i++) {
+        queue->frames[(queue->head + i) % FRAME_QUEUE_SIZE]->refs--;
+    }
+    queue->count = 0;
+    if (close(queue->event_fd) == -1) {
+        print_error("close() failed");
+    }
+    queue->event_fd = -1;
+    pthread_mutex_unlock(&hub->lock);
+
+    hub->num_subscribers--;
+    log("subscribers = %d", hub->num_subscribers);
+    if (hub->num_subscribers == 0) {
+        hub->stop(hub->owner);
+        for (i = 0; i < FRAME_POOL_SIZE; i++) {
+            free(hub->pool[i].data);
+            hub->pool[i].data = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&hub->subscribe_lock);
+}
+
+static void frame_hub_release(FrameHub *hub, const VideoFrame *frame)
+{
+    pthread_mutex_lock(&hub->lock);
+    ((VideoFrame *)frame)->refs--;
+    pthread_mutex_unlock(&hub->lock);
+}
+
+// Returns an unused pool frame with one reference for the producer, or NULL.
+static VideoFrame *frame_hub_get_free(FrameHub *hub)
+{
+    VideoFrame *frame = NULL;
+    int i;
+
+    pthread_mutex_lock(&hub->lock);
+    for (i = 0; i < FRAME_POOL_SIZE; i++) {
+        if (hub->pool[i].refs == 0) {
+            frame = &hub->pool[i];
+            frame->refs = 1;
+            frame->luma_only = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hub->lock);
+
+    if (frame != NULL && frame->data == NULL) {
+        frame->data = alloc_frame_buffer(hub->frame_size);
+        if (frame->data == NULL) {
+            print_error("malloc() failed");
+            frame_hub_release(hub, frame);
+            return NULL;
+        }
+    }
+
+    return frame;
+}
+
+// Queues frame for every subscriber and drops the producer's reference.
+static void frame_hub_publish(FrameHub *hub, VideoFrame *frame)
+{
+    const unsigned long long one = 1;
+    FrameQueue *queue;
+    int i;
+
+    pthread_mutex_lock(&hub->lock);
+    for (i = 0; i < FRAME_HUB_MAX_SUBSCRIBERS; i++) {
+        queue = &hub->queues[i];
+        if (queue->event_fd == -1 || (frame->luma_only && !queue->luma_only)) {
+            continue;
+        }
+        if (queue->count == FRAME_QUEUE_SIZE) {
+            queue->frames[queue->head]->refs--;
+            queue->head = (queue->head + 1) % FRAME_QUEUE_SIZE;
+            queue->count--;
+            if (hub->dropped != NULL) {
+                __sync_fetch_and_add(hub->dropped, 1);
+            }
+        }
+        queue->frames[(queue->head + queue->count) % FRAME_QUEUE_SIZE] = frame;
+        queue->count++;
+        frame->refs++;
+        if (write(queue->event_fd, &one, sizeof(one)) == -1) {
+            print_error("write() failed");
+        }
+    }
+    frame->refs--;
+    pthread_mutex_unlock(&hub->lock);
+}
+
+// Returns the oldest queued frame of the subscriber, or NULL. The frame must
+// be given back with frame_hub_release().
+static const VideoFrame *frame_hub_take(FrameHub *hub, int index)
+{
+    FrameQueue *queue = &hub->queues[index];
+    VideoFrame *frame = NULL;
+
+    pthread_mutex_lock(&hub->lock);
+    if (queue->count > 0) {
+        frame = queue->frames[queue->head];
+        queue->head = (queue->head + 1) % FRAME_QUEUE_SIZE;
+        queue->count--;
+    }
+    pthread_mutex_unlock(&hub->lock);
+
+    return frame;
+}
+
+// Returns true if a frame is queued for the subscriber.
+static bool frame_hub_pending(FrameHub *hub, int index)
+{
+    bool pending;
+
+    pthread_mutex_lock(&hub->lock);
+    pending = hub->queues[index].count > 0;
+    pthread_mutex_unlock(&hub->lock);
+
+    return pending;
+}
+
+// Sets the adaptive rate of a subscriber, 0 if not adaptive.
+static void frame_hub_set_fps(FrameHub *hub, int index, int fps)
+{
+    pthread_mutex_lock(&hub->lock);
+    hub->queues[index].fps = fps;
+    pthread_mutex_unlock(&hub->lock);
+}
+
+// Returns the highest adaptive rate of the subscribers, at least fps.
+static int frame_hub_max_fps(FrameHub *hub, int fps)
+{
+    int i;
+
+    pthread_mutex_lock(&hub->lock);
+    for (i = 0; i < FRAME_HUB_MAX_SUBSCRIBERS; i++) {
+        if (hub->queues[i].event_fd != -1 && hub->queues[i].fps > fps) {
+            fps = hub->queues[i].fps;
+        }
+    }
+    pthread_mutex_unlock(&hub->lock);
+    return fps;
+}
+
+// Returns true if every subscriber reads the Y plane only, then the producer
+// may leave the UV plane out and mark its frames luma_only. Frames marked so
+// are not queued for the other subscribers.
+static bool frame_hub_luma_only(FrameHub *hub)
+{
+    bool luma_only = true;
+    int i;
+
+    pthread_mutex_lock(&hub->lock);
+    for (i = 0; i < FRAME_HUB_MAX_SUBSCRIBERS; i++) {
+        if (hub->queues[i].event_fd != -1 && !hub->queues[i].luma_only) {
+            luma_only = false;
+        }
+    }
+    pthread_mutex_unlock(&hub->lock);
+
+    return luma_only;
+}
+
+// Asks the subscribers connected from peer_addr to leave, by setting closing
+// and waking them up. Subscribers that don't check closing stay.
+static void frame_hub_close_peer(FrameHub *hub, in_addr_t peer_addr)
+{
+    const unsigned long long one = 1;
+    FrameQueue *queue;
+    int i;
+
+    if (peer_addr == INADDR_NONE) {
+        return;
+    }
+    pthread_mutex_lock(&hub->lock);
+    for (i = 0; i < FRAME_HUB_MAX_SUBSCRIBERS; i++) {
+        queue = &hub->queues[i];
+        if (queue->event_fd == -1 || queue->peer_addr != peer_addr) {
+            continue;
+        }
+        queue->closing = true;
+        if (write(queue->event_fd, &one, sizeof(one)) == -1) {
+            print_error("write() failed");
+        }
+    }
+    pthread_mutex_unlock(&hub->lock);
+}
+
+// Returns the adaptive rate of a subscriber connected from peer_addr, or 0.
+static int frame_hub_peer_fps(FrameHub *hub, in_addr_t peer_addr)
+{
+    int fps = 0;
+    int i;
+
+    if (peer_addr == INADDR_NONE) {
+        return 0;
+    }
+    pthread_mutex_lock(&hub->lock);
+    for (i = 0; i < FRAME_HUB_MAX_SUBSCRIBERS; i++) {
+        if (hub->queues[i].event_fd != -1 &&
+            hub->queues[i].peer_addr == peer_addr &&
+            hub->queues[i].fps != 0) {
+            fps = hub->queues[i].fps;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hub->lock);
+    return fps;
+}
+
+// The LCD capture, shared by all video connections
+typedef struct {
+    FrameHub hub;
+    int mem_fd;
+    void *addrs[S_ADDRS_SIZE];
+    unsigned char *staging[S_ADDRS_SIZE]; // cached copies of addrs
+    unsigned char *luma_grid; // of the last published frame
+    pthread_t thread;
+    volatile bool stop;
+    volatile int newest; // index of s_addrs, -1 if not capturing
+    volatile int active_width;
+    volatile int active_height;
+} VideoCapture;
+
+static VideoCapture s_video_capture;
+
+static int s_video_fps;
+
+// Times each copier on the LCD mapping and keeps the fastest one for full
+// frames. The results for smaller sizes are only logged.
+static void calibrate_staging_copy(const void *src, void *dst)
+{
+    static const size_t sizes[] = { 4096, 65536, VIDEO_FRAME_SIZE };
+    const int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    long long start_time, copy_time, best_copy_time = -1;
+    int i, j, k;
+
+    for (i = 0; i < NUM_STAGING_COPIERS; i++) {
+        for (j = 0; j < num_sizes; j++) {
+            copy_time = -1;
+            for (k = 0; k < STAGING_CALIBRATION_ROUNDS; k++) {
+                start_time = get_monotonic_time_us();
+                s_staging_copiers[i].copy(dst, src, sizes[j]);
+                start_time = get_monotonic_time_us() - start_time;
+                if (copy_time == -1 || start_time < copy_time) {
+                    copy_time = start_time;
+                }
+            }
+            log("staging copy %s, %u bytes: %lld us",
+                s_staging_copiers[i].name, (unsigned int)sizes[j], copy_time);
+        }
+        if (best_copy_time == -1 || copy_time < best_copy_time) {
+            best_copy_time = copy_time;
+            s_staging_copier = &s_staging_copiers[i];
+        }
+    }
+
+    log("staging copy = %s", s_staging_copier->name);
+}
+
+// The display rotates through the LCD buffers in a fixed order that is not
+// the address order. next[] is learned from ticks where a single buffer
+// changed, and tells which one is the newest when several changed in a tick.
+static int select_newest_buffer(int next[S_ADDRS_SIZE], int newest,
+                                unsigned int changed)
+{
+    int newest_changed = -1;
+    int i, index;
+
+    if (changed == 0) {
+        return -1;
+    }
+
+    if ((changed & (changed - 1)) == 0) {
+        for (index = 0; !(changed & (1u << index)); index++) {
+        }
+        if (newest != -1 && newest != index) {
+            next[newest] = index;
+        }
+        return index;
+    }
+
+    if (newest != -1) {
+        index = newest;
+        for (i = 0; i < S_ADDRS_SIZE && next[index] != -1; i++) {
+            index = next[index];
+            if (changed & (1u << index)) {
+                newest_changed = index;
+            }
+            if (index == newest) {
+                break;
+            }
+        }
+        if (newest_changed != -1) {
+            return newest_changed;
+        }
+    }
+
+    // order not learned yet
+    for (i = 1; i <= S_ADDRS_SIZE; i++) {
+        index = (newest + i) % S_ADDRS_SIZE;
+        if (changed & (1u << index)) {
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+// The buffers that changed in a tick are told by a sparse fingerprint read
+// straight from the mapping, one FINGERPRINT_BLOCK_SIZE block every
+// VIDEO_SAMPLE_STRIDE bytes (8KB of 518KB). Only the newest buffer is
+// staged and fingerprinted in full. A change the samples miss is still
+// found in the newest buffer, or once the display wrote it to all of them.
+// With only the motion detector subscribed, the Y plane is staged alone and
+// the tick rate is its own, not the vfps of the last stream.
+#define VIDEO_SAMPLE_STRIDE 4096
+
+// The LCD buffers are copied while the display pipeline may write them.
+// The same sparse sample is taken over the whole copy before and after it;
+// the writer crossing any sampled block in between means the copy may be
+// torn and it is made again, up to VIDEO_TEAR_MAX_TRIES times. A write
+// of VIDEO_SAMPLE_STRIDE bytes or more always crosses a sampled block.
+#define VIDEO_TEAR_MAX_TRIES 2
+
+// Copies the first size bytes of LCD buffer src into staging buffer dst.
+// *timestamp is set to the start of the last try. Returns false if every
+// copy was torn.
+static bool stage_lcd_buffer(unsigned char *dst, const unsigned char *src,
+                             size_t size, long long *timestamp)
+{
+    unsigned int before, after;
+    long long start, end;
+    int i;
+
+    for (i = 0; i < VIDEO_TEAR_MAX_TRIES; i++) {
+        start = get_monotonic_time_us();
+        before = fingerprint(src, size, VIDEO_SAMPLE_STRIDE);
+        *timestamp = get_monotonic_time_us();
+        s_staging_copier->copy(dst, src, size);
+        end = get_monotonic_time_us();
+        __sync_fetch_and_add(&s_video_stats.staging_bytes, size);
+        __sync_fetch_and_add(&s_video_stats.staging_us, end - *timestamp);
+
+        after = fingerprint(src, size, VIDEO_SAMPLE_STRIDE);
+        __sync_fetch_and_add(&s_video_stats.tear_check_us,
+                             get_monotonic_time_us() - end + *timestamp
+                             - start);
+        if (after == before) {
+            return true;
+        }
+        __sync_fetch_and_add(&s_video_stats.torn, 1);
+    }
+
+    __sync_fetch_and_add(&s_video_stats.torn_skipped, 1);
+    return false;
+}
+
+// Snapshots the newest changed LCD buffer and publishes it to the video
+// subscribers, at most one per tick. Runs until capture->stop.
+static void *video_capture_thread(void *thread_data)
+{
+    VideoCapture *capture = (VideoCapture *)thread_data;
+    unsigned int samples[S_ADDRS_SIZE] = {0,};
+    unsigned int sample, hash, last_hash = 0;
+    unsigned int changed;
+    int next[S_ADDRS_SIZE];
+    int newest = -1;
+    unsigned int seq = 0;
+    VideoFrame *frame;
+    int i;
+    long long now;
+    long long publish_time = 0;
+    long long detect_time;
+    bool changed_enough;
+    bool luma_only;
+    size_t size;
+    long long timestamp;
+    unsigned char *data;
+    static bool s_staging_calibrated;
+    FILE *hevc;
+    int hevc_state = HEVC_STATE_UNKNOWN;
+    int state;
+    int active_width = FRAME_WIDTH;
+    int active_height = FRAME_HEIGHT;
+    long long active_check_time = 0;
+    long long movie_size_check_time = 0;
+    int subscribers = 0;
+
+    for (i = 0; i < S_ADDRS_SIZE; i++) {
+        next[i] = -1;
+    }
+
+    set_thread_cpus(VIDEO_CAPTURE_CPU, VIDEO_CAPTURE_CPU);
+
+    hevc = fopen(HEVC_STATE_PATH, "r");
+    if (hevc == NULL) {
+        print_error("fopen() failed");
+    }
+
+    if (!s_staging_calibrated) {
+        calibrate_staging_copy(capture->addrs[0], capture->staging[0]);
+        s_staging_calibrated = true;
+    }
+
+    pacer_reset(&s_video_pacer);
+    while (!capture->stop) {
+        now = get_monotonic_time_us() / 1000;
+
+        // the movie size can't be changed while recording. In standby it
+        // is read again now and then and when a subscriber joins, a client
+        // often connects right after changing it.
+        if (hevc != NULL && now >= active_check_time) {
+            active_check_time = now + ACTIVE_AREA_CHECK_INTERVAL_MS;
+            state = read_hevc_state(hevc);
+            if (state != HEVC_STATE_UNKNOWN &&
+                (state != hevc_state ||
+                 (state != HEVC_STATE_ON &&
+                  (now >= movie_size_check_time ||
+                   capture->hub.num_subscribers > subscribers)))) {
+                hevc_state = state;
+                movie_size_check_time = now + MOVIE_SIZE_CHECK_INTERVAL_MS;
+                get_active_area(hevc_state, read_movie_size(),
+                                &active_width, &active_height);
+                if (active_width != capture->active_width ||
+                    active_height != capture->active_height) {
+                    capture->active_width = active_width;
+                    capture->active_height = active_height;
+                    log("active area = %dx%d", active_width, active_height);
+                }
+            }
+            subscribers = capture->hub.num_subscribers;
+        }
+
+        changed = 0;
+        for (i = 0; i < S_ADDRS_SIZE; i++) {
+            sample = fingerprint(capture->addrs[i], VIDEO_FRAME_SIZE,
+                                 VIDEO_SAMPLE_STRIDE);
+            if (samples[i] != 0 && sample != samples[i]) {
+                changed |= 1u << i;
+            }
+            samples[i] = sample;
+        }
+
+        luma_only = frame_hub_luma_only(&capture->hub);
+        size = luma_only ? FRAME_WIDTH * FRAME_HEIGHT : VIDEO_FRAME_SIZE;
+
+        i = select_newest_buffer(next, newest, changed);
+        if (i != -1) {
+            newest = i;
+            capture->newest = newest;
+        }
+        // a buffer that was held back as noise is checked again
+        i = newest;
+
+        // a buffer still being written is left for the next tick, then the
+        // staged planes of the whole frame are hashed
+        hash = last_hash;
+        if (i != -1 &&
+            stage_lcd_buffer(capture->staging[i], capture->addrs[i], size,
+                             &timestamp)) {
+            hash = fingerprint(capture->staging[i], size,
+                               FINGERPRINT_BLOCK_SIZE);
+        }
+
+        // skip content that is already sent from another buffer
+        frame = NULL;
+        if (hash != last_hash) {
+            changed_enough = true;
+            if (s_video_change_threshold > 0 && publish_time != 0 &&
+                now - publish_time < s_video_refresh_ms) {
+                detect_time = get_monotonic_time_us();
+                changed_enough = luma_changed(capture->staging[i],
+                                              capture->luma_grid,
+                                              s_video_change_threshold);
+                __sync_fetch_and_add(&s_video_stats.change_detect_us,
+                                     get_monotonic_time_us() - detect_time);
+            }
+            if (changed_enough) {
+                frame = frame_hub_get_free(&capture->hub);
+            } else if (changed != 0) {
+                __sync_fetch_and_add(&s_video_stats.static_skipped, 1);
+            }
+        }
+        if (frame != NULL) {
+            update_luma_grid(capture->luma_grid, capture->staging[i]);
+            publish_time = now;
+
+            // hand the staged copy over instead of copying it again
+            data = frame->data;
+            frame->data = capture->staging[i];
+            capture->staging[i] = data;
+            frame->timestamp = timestamp;
+            frame->seq = seq++;
+            frame->buffer_index = i;
+            frame->width = active_width;
+            frame->height = active_height;
+            frame->luma_only = luma_only;
+            last_hash = hash;
+
+            frame_hub_publish(&capture->hub, frame);
+            __sync_fetch_and_add(&s_video_stats.captured, 1);
+            //log("[VideoCapture] %d, hash = %08x (changed!)", i, hash);
+        }
+
+        pacer_wait(&s_video_pacer,
+                   frame_hub_max_fps(&capture->hub,
+                                     luma_only ? 0 : s_video_fps));
+    }
+
+    if (hevc != NULL && fclose(hevc)) {
+        print_error("fclose() failed");
+    }
+
+    return NULL;
+}
+
+typedef struct {
+    int client_fd;
+    bool splice_disabled; // vmsplice() is not usable, use write()
+    int pipe_fds[2];
+    bool spliced; // the socket still references pages of the current frame
+    int udp_fd;   // connected to udp_port of the client, or -1
+    int udp_port; // 0 = TCP
+    int udp_unreachable_port;
+    unsigned int udp_message_id;
+    bool udp_cut; // a message of the current frame was cut, ENOBUFS
+} VideoSender;
+
+static void video_sender_init(VideoSender *sender, int client_fd)
+{
+    sender->client_fd = client_fd;
+    sender->splice_disabled = false;
+    sender->pipe_fds[0] = -1;
+    sender->pipe_fds[1] = -1;
+    sender->spliced = false;
+    sender->udp_fd = -1;
+    sender->udp_port = 0;
+    sender->udp_unreachable_port = 0;
+    sender->udp_message_id = 0;
+}
+
+static void video_sender_close_udp(VideoSender *sender)
+{
+    if (sender->udp_fd != -1 && close(sender->udp_fd) == -1) {
+        print_error("close() failed");
+    }
+    sender->udp_fd = -1;
+}
+
+static void video_sender_destroy(VideoSender *sender)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (sender->pipe_fds[i] != -1 && close(sender->pipe_fds[i]) == -1) {
+            print_error("close() failed");
+        }
+        sender->pipe_fds[i] = -1;
+    }
+    video_sender_close_udp(sender);
+}
+
+static int video_sender_open_udp(VideoSender *sender, int port)
+{
+    struct sockaddr_in addr;
+    int size = VIDEO_UDP_SNDBUF_SIZE;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = get_peer_addr(sender->client_fd);
+    addr.sin_port = htons(port);
+    if (addr.sin_addr.s_addr == INADDR_NONE) {
+        log("udp transport needs an IPv4 client.");
+        return -1;
+    }
+
+    sender->udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sender->udp_fd == -1) {
+        print_error("socket() failed");
+        return -1;
+    }
+    // a whole frame fits, the datagrams of one message go out in a burst
+    setsockopt(sender->udp_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    // connected, so an unreachable port is reported by sendmsg()
+    if (connect(sender->udp_fd, (struct sockaddr *)&addr,
+                sizeof(addr)) == -1) {
+        print_error("connect() failed");
+        video_sender_close_udp(sender);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Follows "transport=" of options. Returns true if the transport changed,
+// the client is then told with a VIDEO_MSG_TRANSPORT message on TCP.
+static bool video_sender_update_transport(VideoSender *sender,
+                                          const VideoOptions *options)
+{
+    int port = options->udp_port;
+
+    if (port == 0) {
+        sender->udp_unreachable_port = 0;
+    }
+    if ((options->mode != VIDEO_MODE_FRAME &&
+         options->mode != VIDEO_MODE_JPEG &&
+         options->mode != VIDEO_MODE_PROGRESSIVE) ||
+        port == sender->udp_unreachable_port) {
+        port = 0;
+    }
+    if (port == sender->udp_port && (port == 0 || sender->udp_fd != -1)) {
+        return false;
+    }
+
+    video_sender_close_udp(sender);
+    if (port != 0 && video_sender_open_udp(sender, port) == -1) {
+        sender->udp_unreachable_port = port;
+        port = 0;
+    }
+    if (port == sender->udp_port) {
+        return false;
+    }
+    sender->udp_port = port;
+    log("video transport = %s:%d", port != 0 ? "udp" : "tcp", port);
+
+    return true;
+}
+
+// Sends header and payload as one message in datagrams. Returns -1 if the
+// client can't be reached over UDP.
+static int video_sender_send_udp(VideoSender *sender,
+                                 const unsigned char *header,
+                                 size_t header_size,
+                                 const unsigned char *payload,
+                                 size_t payload_size)
+{
+    unsigned char fragment_header[VIDEO_UDP_HEADER_SIZE];
+    const size_t message_size = header_size + payload_size;
+    const int count = (message_size + VIDEO_UDP_DATA_SIZE - 1)
+                      / VIDEO_UDP_DATA_SIZE;
+    const unsigned int id = sender->udp_message_id++;
+    struct iovec iov[3];
+    struct msghdr msg;
+    size_t offset, size, start;
+    unsigned char *p;
+    int i;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    for (i = 0; i < count; i++) {
+        offset = (size_t)i * VIDEO_UDP_DATA_SIZE;
+        size = message_size - offset;
+        if (size > VIDEO_UDP_DATA_SIZE) {
+            size = VIDEO_UDP_DATA_SIZE;
+        }
+
+        p = put_u32(fragment_header, VIDEO_UDP_MAGIC);
+        p = put_u32(p, id);
+        p = put_u16(p, i);
+        put_u16(p, count);
+        iov[0].iov_base = fragment_header;
+        iov[0].iov_len = sizeof(fragment_header);
+        msg.msg_iovlen = 1;
+        if (offset < header_size) {
+            iov[msg.msg_iovlen].iov_base = (void *)(header + offset);
+            iov[msg.msg_iovlen].iov_len = header_size - offset < size ?
+                                          header_size - offset : size;
+            msg.msg_iovlen++;
+        }
+        if (offset + size > header_size) {
+            start = offset > header_size ? offset - header_size : 0;
+            iov[msg.msg_iovlen].iov_base = (void *)(payload + start);
+            iov[msg.msg_iovlen].iov_len = offset + size - header_size - start;
+            msg.msg_iovlen++;
+        }
+
+        while (sendmsg(sender->udp_fd, &msg, 0) == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == ENOBUFS) {
+                // the rest is useless without this fragment
+                sender->udp_cut = true;
+                __sync_fetch_and_add(&s_video_stats.udp_cut, 1);
+                return 0;
+            }
+            print_error("sendmsg() failed");
+            return -1;
+        }
+        __sync_fetch_and_add(&s_video_stats.udp_datagrams, 1);
+        __sync_fetch_and_add(&s_video_stats.udp_bytes,
+                             sizeof(fragment_header) + size);
+    }
+
+    return 0;
+}
+
+// Moves the pages of buf into the socket through the staging pipe.
+// Returns the number of bytes that reached the socket, or -1 on a socket
+// error. A short count means vmsplice() is not supported.
+static ssize_t video_sender_splice(VideoSender *sender,
+                                   const unsigned char *buf, size_t size)
+{
+    struct iovec iov;
+    ssize_t splice_size, moved_size;
+    size_t sent_size = 0;
+
+    if (sender->pipe_fds[0] == -1) {
+        if (pipe(sender->pipe_fds) == -1) {
+            print_error("pipe() failed");
+            return 0;
+        }
+        // fewer round trips per frame, the default pipe holds only 64 KiB
+        fcntl(sender->pipe_fds[1], F_SETPIPE_SZ, VIDEO_SPLICE_PIPE_SIZE);
+    }
+
+    while (sent_size < size) {
+        iov.iov_base = (void *)(buf + sent_size);
+        iov.iov_len = size - sent_size;
+        splice_size = vmsplice(sender->pipe_fds[1], &iov, 1, 0);
+        if (splice_size == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            print_error("vmsplice() failed");
+            break;
+        }
+        sender->spliced = true;
+
+        while (splice_size > 0) {
+            moved_size = splice(sender->pipe_fds[0], NULL,
+                                sender->client_fd, NULL, splice_size,
+                                SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (moved_size == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            splice_size -= moved_size;
+            sent_size += moved_size;
+        }
+    }
+
+    return sent_size;
+}
+
+static int video_sender_send(VideoSender *sender, const VideoOptions *options,
+                             const void *buf, size_t size)
+{
+    long long cpu_time = get_thread_cpu_time_us();
+    ssize_t sent_size = 0;
+    int ret;
+
+    if (options->send_method == VIDEO_SEND_SPLICE &&
+        !sender->splice_disabled && size >= VIDEO_SPLICE_MIN_SIZE) {
+        sent_size = video_sender_splice(sender, buf, size);
+        if (sent_size == -1) {
+            return -1;
+        }
+        __sync_fetch_and_add(&s_video_stats.splice_bytes, sent_size);
+        if (sent_size < size) {
+            log("vmsplice() is not usable, fall back to write().");
+            sender->splice_disabled = true;
+        }
+        __sync_fetch_and_add(&s_video_stats.splice_cpu_us,
+                             get_thread_cpu_time_us() - cpu_time);
+        cpu_time = get_thread_cpu_time_us();
+    }
+
+    ret = write_all(sender->client_fd, (const unsigned char *)buf + sent_size,
+                    size - sent_size);
+    __sync_fetch_and_add(&s_video_stats.write_bytes, size - sent_size);
+    __sync_fetch_and_add(&s_video_stats.write_cpu_us,
+                         get_thread_cpu_time_us() - cpu_time);
+
+    return ret;
+}
+
+// Sends one framed message, over UDP if the client selected it.
+static int video_sender_send_msg(VideoSender *sender,
+                                 const VideoOptions *options,
+                                 const void *header, size_t header_size,
+                                 const void *payload, size_t payload_size)
+{
+    if (sender->udp_fd != -1) {
+        if (video_sender_send_udp(sender, header, header_size, payload,
+                                  payload_size) == 0) {
+            return 0;
+        }
+        // back to TCP from the next frame on
+        log("udp port %d is unreachable.", sender->udp_port);
+        sender->udp_unreachable_port = sender->udp_port;
+        video_sender_close_udp(sender);
+        return 0;
+    }
+
+    if (header_size != 0 &&
+        video_sender_send(sender, options, header, header_size) == -1) {
+        return -1;
+    }
+    return video_sender_send(sender, options, payload, payload_size);
+}
+
+// Returns the socket whose send queue the adaptive rate watches, the one
+// the frames go out on.
+static int video_sender_queue_fd(const VideoSender *sender)
+{
+    return sender->udp_fd != -1 ? sender->udp_fd : sender->client_fd;
+}
+
+// Spliced pages stay referenced by the socket until they are acknowledged,
+// so the frame can't be handed back to the capture thread before that.
+static void video_sender_finish_frame(VideoSender *sender)
+{
+    long long timeout = get_current_time() + VIDEO_SPLICE_DRAIN_TIMEOUT_MS;
+    int outq;
+
+    if (!sender->spliced) {
+        return;
+    }
+    sender->spliced = false;
+
+    while (ioctl(sender->client_fd, SIOCOUTQ, &outq) == 0 && outq > 0) {
+        if (get_current_time() > timeout) {
+            log("socket is not drained. outq = %d", outq);
+            break;
+        }
+        usleep(1000);
+    }
+}
+
+// Frame rate of one connection that follows the network, between min_fps
+// and max_fps. Before each frame, the previous one is checked: if more than
+// half of it is still in the socket buffer (SIOCOUTQ) or writing it took
+// more than half the frame interval, the rate is cut by a quarter. A second
+// of frames without either adds 1 fps. Over UDP the send queue of the UDP
+// socket is watched, and a message cut by ENOBUFS also cuts the rate.
+typedef struct {
+    int fps;
+    int min_fps;
+    int max_fps;
+    long long next_time; // us, CLOCK_MONOTONIC
+    long long send_time; // us, writing the last frame
+    int queued;          // SIOCOUTQ after the last frame
+    bool cut;            // a message of the last frame was dropped
+    bool sent;
+    int good_frames;
+} AdaptiveRate;
+
+static void adaptive_rate_init(AdaptiveRate *rate, int min_fps, int max_fps,
+                               int fps)
+{
+    memset(rate, 0, sizeof(*rate));
+    rate->min_fps = min_fps < ADAPTIVE_FPS_MIN ? ADAPTIVE_FPS_MIN : min_fps;
+    rate->max_fps = max_fps < rate->min_fps ? rate->min_fps : max_fps;
+    rate->fps = fps < rate->min_fps ? rate->min_fps
+              : fps > rate->max_fps ? rate->max_fps : fps;
+}
+
+// Returns true if a frame can be sent at now (us). fd is the socket the
+// frames go out on.
+static bool adaptive_rate_due(AdaptiveRate *rate, int fd, long long now)
+{
+    long long interval = 1000000ll / rate->fps;
+    int outq, fps = rate->fps;
+
+    if (now < rate->next_time) {
+        return false;
+    }
+
+    if (rate->sent) {
+        if (ioctl(fd, SIOCOUTQ, &outq) == -1) {
+            outq = 0;
+        }
+        if (outq > rate->queued / 2 || rate->send_time > interval / 2 ||
+            rate->cut) {
+            fps = fps * 3 / 4 < fps - 1 ? fps * 3 / 4 : fps - 1;
+            rate->good_frames = 0;
+        } else if (++rate->good_frames >= fps) {
+            fps++;
+            rate->good_frames = 0;
+        }
+        fps = fps < rate->min_fps ? rate->min_fps
+            : fps > rate->max_fps ? rate->max_fps : fps;
+        if (fps != rate->fps) {
+            log("fps %d -> %d (outq = %d, send = %lld us)", rate->fps, fps,
+                outq, rate->send_time);
+            rate->fps = fps;
+            interval = 1000000ll / fps;
+        }
+    }
+
+    // frames come at the capture rate, take them a bit early
+    rate->next_time = now + interval * 3 / 4;
+    return true;
+}
+
+static void adaptive_rate_sent(AdaptiveRate *rate, int fd,
+                               long long send_time, bool cut)
+{
+    if (ioctl(fd, SIOCOUTQ, &rate->queued) == -1) {
+        rate->queued = 0;
+    }
+    rate->send_time = send_time;
+    rate->cut = cut;
+    rate->sent = true;
+}
+
+#ifdef USE_LIBJPEG
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} JpegErrorManager;
+
+// libjpeg calls exit() on errors by default
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    JpegErrorManager *err = (JpegErrorManager *)cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, msg);
+    log("libjpeg error: %s", msg);
+    longjmp(err->jmp, 1);
+}
+#endif
+
+typedef struct {
+    VideoSender sender;
+#ifdef USE_LIBJPEG
+    struct jpeg_compress_struct jpeg;
+    JpegErrorManager jpeg_err;
+    bool jpeg_created;
+    unsigned char *jpeg_buf;
+    unsigned long jpeg_buf_size; // allocated, not used
+    // output of jpeg_mem_dest(), kept here to be valid after longjmp()
+    unsigned char *jpeg_dest;
+    unsigned long jpeg_dest_size;
+    unsigned char *jpeg_row; // one row of interleaved YCbCr
+#endif
+    unsigned char *scale_bufs[2];
+    unsigned char *shadow; // last sent image, VIDEO_MODE_TILE
+    unsigned char *tile_buf;
+    int shadow_width;
+    int shadow_height;
+    unsigned char *layer_buf; // VIDEO_MODE_PROGRESSIVE
+    unsigned char *peaking_buf;
+    unsigned char *peaking_row;
+    FrameHub *hub;            // newer frames pre-empt layers
+    int hub_index;
+    bool frame_sent;
+} VideoSession;
+
+static void video_session_init(VideoSession *session, int client_fd)
+{
+    memset(session, 0, sizeof(*session));
+    video_sender_init(&session->sender, client_fd);
+}
+
+static void video_session_destroy(VideoSession *session)
+{
+    video_sender_destroy(&session->sender);
+#ifdef USE_LIBJPEG
+    if (session->jpeg_created) {
+        jpeg_destroy_compress(&session->jpeg);
+    }
+    free(session->jpeg_buf);
+    free(session->jpeg_row);
+#endif
+    free(session->scale_bufs[0]);
+    free(session->scale_bufs[1]);
+    free(session->shadow);
+    free(session->tile_buf);
+    free(session->layer_buf);
+    free(session->peaking_buf);
+    free(session->peaking_row);
+}
+
+// NV12 needs even positions and sizes
+static int clamp_even(int value, int min, int max)
+{
+    value &= ~1;
+    return value < min ? min : value > max ? max : value;
+}
+
+// Sets view to the crop rectangle of options within frame, not copied.
+static void crop_video_frame(const VideoOptions *options,
+                             const VideoFrame *frame, Nv12Image *view)
+{
+    int src_width = frame->width, src_height = frame->height;
+    int crop_x, crop_y;
+
+    // raw clients always get the letterboxed frame, they don't know its size
+    if (options->mode == VIDEO_MODE_RAW) {
+        src_width = FRAME_WIDTH;
+        src_height = FRAME_HEIGHT;
+    }
+    nv12_image_init(view, frame->data, src_width, src_height);
+    if (options->crop_width == 0) {
+        return;
+    }
+
+    crop_x = clamp_even(options->crop_x, 0, src_width - 2);
+    crop_y = clamp_even(options->crop_y, 0, src_height - 2);
+    view->y += crop_y * view->stride + crop_x;
+    view->uv += crop_y / 2 * view->stride + crop_x;
+    view->width = clamp_even(options->crop_width, 2, src_width - crop_x);
+    view->height = clamp_even(options->crop_height, 2, src_height - crop_y);
+}
+
+// Crops and downscales frame as requested by options into a packed image.
+// Halving passes are used while they don't go below the target size, a box
+// filter does the rest. Returns -1 if the scale buffers can't be allocated.
+static int scale_video_frame(VideoSession *session, const VideoOptions *options,
+                             const VideoFrame *frame, Nv12Image *image)
+{
+    Nv12Image view, dst;
+    int width, height;
+    int i;
+
+    crop_video_frame(options, frame, &view);
+    if (options->width > 0) {
+        width = clamp_even(options->width, 2, view.width);
+        height = clamp_even(options->height, 2, view.height);
+    } else {
+        width = clamp_even(view.width / options->scale, 2, view.width);
+        height = clamp_even(view.height / options->scale, 2, view.height);
+    }
+
+    // whole frame, already packed
+    if (view.stride == width && view.height == height &&
+        view.uv == view.y + width * height) {
+        *image = view;
+        return 0;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (session->scale_bufs[i] == NULL) {
+            session->scale_bufs[i] = malloc(VIDEO_FRAME_SIZE);
+            if (session->scale_bufs[i] == NULL) {
+                print_error("malloc() failed");
+                return -1;
+            }
+        }
+    }
+
+    for (i = 0; view.width / 2 >= width && view.height / 2 >= height &&
+         view.width % 4 == 0 && view.height % 4 == 0; i ^= 1) {
+        nv12_image_init(&dst, session->scale_bufs[i], view.width / 2,
+                        view.height / 2);
+        nv12_downscale_half(&view, &dst);
+        view = dst;
+    }
+
+    nv12_image_init(image, session->scale_bufs[i], width, height);
+    if (view.width != width || view.height != height) {
+        nv12_downscale_box(&view, image, width, height);
+    } else if (view.stride != width) {
+        // crop only
+        nv12_copy(&view, image);
+    } else {
+        *image = view;
+    }
+
+    return 0;
+}
+
+#ifdef USE_LIBJPEG
+// Compresses image into session->jpeg_buf. Returns the JPEG size, or 0 on
+// error.
+static unsigned long encode_video_jpeg(VideoSession *session,
+                                       const VideoOptions *options,
+                                       const Nv12Image *image)
+{
+    struct jpeg_compress_struct *cinfo = &session->jpeg;
+    unsigned long jpeg_size;
+    long long start_time = get_monotonic_time_us();
+    JSAMPROW row_pointer[1];
+    int x;
+
+    if (session->jpeg_row == NULL) {
+        session->jpeg_row = malloc(FRAME_WIDTH * 3);
+        if (session->jpeg_row == NULL) {
+            print_error("malloc() failed");
+            return 0;
+        }
+    }
+    if (!session->jpeg_created) {
+        cinfo->err = jpeg_std_error(&session->jpeg_err.pub);
+        session->jpeg_err.pub.error_exit = jpeg_error_exit;
+        jpeg_create_compress(cinfo);
+        session->jpeg_created = true;
+    }
+    session->jpeg_dest = session->jpeg_buf;
+    session->jpeg_dest_size = session->jpeg_buf_size;
+    if (setjmp(session->jpeg_err.jmp)) {
+        jpeg_abort_compress(cinfo);
+        // a buffer grown by jpeg_mem_dest() is not freed by libjpeg
+        if (session->jpeg_dest != session->jpeg_buf) {
+            free(session->jpeg_dest);
+        }
+        return 0;
+    }
+
+    jpeg_mem_dest(cinfo, &session->jpeg_dest, &session->jpeg_dest_size);
+    cinfo->image_width = image->width;
+    cinfo->image_height = image->height;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, options->jpeg_quality, TRUE);
+    cinfo->dct_method = JDCT_IFAST;
+    cinfo->comp_info[0].h_samp_factor =
+            options->jpeg_subsampling == 444 ? 1 : 2;
+    cinfo->comp_info[0].v_samp_factor =
+            options->jpeg_subsampling == 420 ? 2 : 1;
+
+    jpeg_start_compress(cinfo, TRUE);
+    row_pointer[0] = session->jpeg_row;
+    while (cinfo->next_scanline < cinfo->image_height) {
+        const unsigned char *src_y = image->y
+                                     + cinfo->next_scanline * image->stride;
+        const unsigned char *src_uv = image->uv
+                                      + cinfo->next_scanline / 2
+                                      * image->stride;
+        unsigned char *p = session->jpeg_row;
+
+        // the LCD buffer has V before U
+        for (x = 0; x < image->width; x++) {
+            *p++ = src_y[x];
+            *p++ = src_uv[x | 1];
+            *p++ = src_uv[x & ~1];
+        }
+        jpeg_write_scanlines(cinfo, row_pointer, 1);
+    }
+    jpeg_finish_compress(cinfo);
+    jpeg_size = session->jpeg_dest_size;
+
+    // jpeg_mem_dest() allocates a new buffer if the old one is too small
+    // and doesn't tell its size, it is resized to a known capacity with
+    // room for the next frames
+    if (session->jpeg_dest != session->jpeg_buf) {
+        free(session->jpeg_buf);
+        session->jpeg_buf_size = jpeg_size + jpeg_size / 4;
+        session->jpeg_buf = realloc(session->jpeg_dest,
+                                    session->jpeg_buf_size);
+        if (session->jpeg_buf == NULL) {
+            print_error("realloc() failed");
+            free(session->jpeg_dest);
+            session->jpeg_buf_size = 0;
+            return 0;
+        }
+    }
+
+    __sync_fetch_and_add(&s_video_stats.jpeg_frames, 1);
+    __sync_fetch_and_add(&s_video_stats.jpeg_bytes, jpeg_size);
+    __sync_fetch_and_add(&s_video_stats.jpeg_encode_us,
+                         get_monotonic_time_us() - start_time);
+
+    return jpeg_size;
+}
+#endif
+
+// Sends the layers of image, coarsest first, until all are sent or a newer
+// frame is queued for the session.
+static int send_video_layers(VideoSession *session,
+                             const VideoOptions *options,
+                             const VideoFrame *frame, const Nv12Image *image)
+{
+    VideoSender *sender = &session->sender;
+    unsigned char header[VIDEO_MSG_HEADER_SIZE];
+    unsigned char *layer_buf;
+    size_t layer_size;
+    int layer;
+
+    if (session->layer_buf == NULL) {
+        session->layer_buf = malloc(VIDEO_LAYER_BUF_SIZE);
+        if (session->layer_buf == NULL) {
+            print_error("malloc() failed");
+            return -1;
+        }
+    }
+
+    layer_buf = session->layer_buf;
+    for (layer = 0; layer < VIDEO_LAYERS; layer++) {
+        if (layer != 0 && frame_hub_pending(session->hub,
+                                            session->hub_index)) {
+            __sync_fetch_and_add(&s_video_stats.preempted, 1);
+            break;
+        }
+
+        layer_size = pack_video_layer(image, layer, layer_buf);
+        put_video_msg_header(header, VIDEO_MSG_LAYER, frame, image->width,
+                             image->height, layer, layer_size);
+        if (video_sender_send_msg(sender, options, header, sizeof(header),
+                                  layer_buf, layer_size) == -1) {
+            return -1;
+        }
+        layer_buf += layer_size;
+        __sync_fetch_and_add(&s_video_stats.layers, 1);
+    }
+
+    return 0;
+}
+
+// Sends the focus peaking mask of the crop rectangle of frame.
+static int send_video_peaking(VideoSession *session,
+                              const VideoOptions *options,
+                              const VideoFrame *frame)
+{
+    unsigned char header[VIDEO_MSG_HEADER_SIZE];
+    long long start_time = get_monotonic_time_us();
+    Nv12Image view;
+    size_t size;
+
+    if (session->peaking_buf == NULL) {
+        session->peaking_buf = malloc(VIDEO_PEAKING_BUF_SIZE);
+        session->peaking_row = malloc(FRAME_WIDTH);
+        if (session->peaking_buf == NULL || session->peaking_row == NULL) {
+            print_error("malloc() failed");
+            return -1;
+        }
+    }
+
+    crop_video_frame(options, frame, &view);
+    size = encode_peaking_mask(&view, options->peaking_threshold,
+                               session->peaking_row, session->peaking_buf);
+    __sync_fetch_and_add(&s_video_stats.peaking_masks, 1);
+    __sync_fetch_and_add(&s_video_stats.peaking_bytes, size);
+    __sync_fetch_and_add(&s_video_stats.peaking_us,
+                         get_monotonic_time_us() - start_time);
+
+    put_video_msg_header(header, VIDEO_MSG_PEAKING, frame, view.width,
+                         view.height, options->peaking_threshold, size);
+    return video_sender_send_msg(&session->sender, options, header,
+                                 sizeof(header), session->peaking_buf, size);
+}
+
+static int send_video_frame(VideoSession *session, const VideoOptions *options,
+                            const VideoFrame *frame)
+{
+    VideoSender *sender = &session->sender;
+    unsigned char header[VIDEO_MSG_HEADER_SIZE];
+    Nv12Image image;
+    size_t tile_size;
+#ifdef USE_LIBJPEG
+    unsigned long jpeg_size;
+#endif
+    bool force;
+    int ret;
+
+    sender->udp_cut = false;
+    if (scale_video_frame(session, options, frame, &image) == -1) {
+        return -1;
+    }
+
+    if (video_sender_update_transport(sender, options)) {
+        put_video_msg_header(header, VIDEO_MSG_TRANSPORT, frame, 0, 0,
+                             sender->udp_port, 0);
+        if (video_sender_send(sender, options, header,
+                              sizeof(header)) == -1) {
+            return -1;
+        }
+    }
+
+    if (options->mode == VIDEO_MODE_TILE) {
+        if (session->shadow == NULL) {
+            session->shadow = malloc(VIDEO_FRAME_SIZE);
+            session->tile_buf = malloc(VIDEO_TILE_BUF_SIZE);
+            if (session->shadow == NULL || session->tile_buf == NULL) {
+                print_error("malloc() failed");
+                return -1;
+            }
+        }
+
+        // the first frame and size changes are sent as a whole to fill the
+        // shadow
+        force = !session->frame_sent ||
+                image.width != session->shadow_width ||
+                image.height != session->shadow_height;
+        session->shadow_width = image.width;
+        session->shadow_height = image.height;
+
+        tile_size = encode_video_tiles(frame, &image, session->shadow,
+                                       session->tile_buf, force);
+        if (tile_size == 0) {
+            return 0;
+        }
+        ret = video_sender_send(sender, options, session->tile_buf,
+                                tile_size);
+    } else if (options->mode == VIDEO_MODE_PROGRESSIVE) {
+        ret = send_video_layers(session, options, frame, &image);
+#ifdef USE_LIBJPEG
+    } else if (options->mode == VIDEO_MODE_JPEG) {
+        jpeg_size = encode_video_jpeg(session, options, &image);
+        if (jpeg_size == 0) {
+            return 0;
+        }
+        put_video_msg_header(header, VIDEO_MSG_JPEG, frame, image.width,
+                             image.height, 1, jpeg_size);
+        ret = video_sender_send_msg(sender, options, header, sizeof(header),
+                                    session->jpeg_buf, jpeg_size);
+#endif
+    } else if (options->mode == VIDEO_MODE_FRAME) {
+        put_video_msg_header(header, VIDEO_MSG_FRAME, frame, image.width,
+                             image.height, 1, nv12_image_size(&image));
+        // packed, so Y and UV are contiguous
+        ret = video_sender_send_msg(sender, options, header, sizeof(header),
+                                    image.y, nv12_image_size(&image));
+    } else {
+        ret = video_sender_send(sender, options, image.y,
+                                nv12_image_size(&image));
+    }
+    if (ret == 0 && options->peaking && options->mode != VIDEO_MODE_RAW) {
+        ret = send_video_peaking(session, options, frame);
+    }
+    video_sender_finish_frame(sender);
+
+    return ret;
+}
+
+// Video sender. Frames are captured on video_capture_thread(), so a slow
+// client only makes the sender skip to the newest frame.
+static void video_capture_release(VideoCapture *capture)
+{
+    int i;
+
+    for (i = 0; i < S_ADDRS_SIZE; i++) {
+        if (capture->addrs[i] != NULL) {
+            munmap_lcd(capture->addrs[i], s_addrs[i]);
+            capture->addrs[i] = NULL;
+        }
+        free(capture->staging[i]);
+        capture->staging[i] = NULL;
+    }
+    free(capture->luma_grid);
+    capture->luma_grid = NULL;
+
+    if (capture->mem_fd != -1 && close(capture->mem_fd) == -1) {
+        print_error("close failed");
+    }
+    capture->mem_fd = -1;
+}
+
+static bool video_capture_start(void *owner)
+{
+    VideoCapture *capture = (VideoCapture *)owner;
+    int i;
+
+    capture->stop = false;
+    capture->newest = -1;
+    capture->active_width = FRAME_WIDTH;
+    capture->active_height = FRAME_HEIGHT;
+    capture->mem_fd = open("/dev/mem", O_RDWR);
+    if (capture->mem_fd == -1) {
+        die("open() error");
+    }
+
+    for (i = 0; i < S_ADDRS_SIZE; i++) {
+        capture->addrs[i] = mmap_lcd(capture->mem_fd, s_addrs[i]);
+        capture->staging[i] = alloc_frame_buffer(VIDEO_FRAME_SIZE);
+        if (capture->staging[i] == NULL) {
+            print_error("malloc() failed");
+            goto error;
+        }
+    }
+
+    capture->luma_grid = alloc_frame_buffer(VIDEO_CHANGE_GRID_SIZE);
+    if (capture->luma_grid == NULL) {
+        print_error("malloc() failed");
+        goto error;
+    }
+
+    if (pthread_create(&capture->thread, NULL, video_capture_thread,
+                       capture)) {
+        print_error("pthread_create() failed");
+        goto error;
+    }
+
+    return true;
+
+error:
+    video_capture_release(capture);
+    return false;
+}
+
+static void video_capture_stop(void *owner)
+{
+    VideoCapture *capture = (VideoCapture *)owner;
+
+    capture->stop = true;
+    if (pthread_join(capture->thread, NULL)) {
+        print_error("pthread_join() failed");
+    }
+    capture->newest = -1;
+    video_capture_release(capture);
+}
+
+// Video sender, one per connection. Frames are captured once for all
+// connections on video_capture_thread(), so a slow client only gets its
+// oldest queued frames dropped.
+static void *start_video_capture(StreamerData *data)
+{
+    int client_fd = data->client_fd;
+    int fps = data->fps;
+    FrameHub *hub = &s_video_capture.hub;
+    int index;
+    struct pollfd pfds[2];
+    unsigned long long events;
+    const VideoFrame *frame;
+    bool err = false;
+#ifdef DEBUG
+    long long capture_start_time, capture_end_time;
+#endif
+    VideoOptions options;
+    OptionReader option_reader = { {0,}, 0 };
+    VideoSession session;
+    AdaptiveRate rate;
+    long long send_time;
+
+    free(data);
+
+    video_options_init(&options);
+    video_session_init(&session, client_fd);
+
+    pin_off_capture_cpu();
+
+    // give new clients a chance to select the mode before the first frame
+    if (!read_video_options(client_fd, &option_reader, &options,
+                            VIDEO_OPTIONS_TIMEOUT_MS, false)) {
+        return NULL;
+    }
+
+    frame_hub_set_start_fps(hub, &s_video_fps, fps);
+    adaptive_rate_init(&rate, options.fps_min, options.fps_max, s_video_fps);
+    index = frame_hub_subscribe(hub, get_peer_addr(client_fd),
+                                options.fps_max != 0 ? rate.fps : 0, false);
+    if (index == -1) {
+        video_session_destroy(&session);
+        return NULL;
+    }
+    session.hub = hub;
+    session.hub_index = index;
+
+#ifdef DEBUG
+    capture_start_time = get_current_time();
+#endif
+    pfds[0].fd = client_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = hub->queues[index].event_fd;
+    pfds[1].events = POLLIN;
+    while (!err) {
+        // the notify connection of the same phone is gone
+        if (hub->queues[index].closing) {
+            log("video client closed by notify.");
+            break;
+        }
+
+        pfds[0].revents = 0;
+        pfds[1].revents = 0;
+        if (poll(pfds, 2, 100) == -1 && errno != EINTR) {
+            print_error("poll() failed");
+            break;
+        }
+
+        if (pfds[0].revents &&
+            !read_video_options(client_fd, &option_reader, &options, 0,
+                                session.frame_sent)) {
+            log("video client closed.");
+            break;
+        }
+
+        if (!pfds[1].revents) {
+            continue;
+        }
+        if (read(pfds[1].fd, &events, sizeof(events)) == -1) {
+            print_error("read() failed");
+        }
+
+        if (options.fps_max != 0 &&
+            (options.fps_min != rate.min_fps ||
+             options.fps_max != rate.max_fps)) {
+            adaptive_rate_init(&rate, options.fps_min, options.fps_max,
+                               rate.fps);
+        }
+
+        while (!err && (frame = frame_hub_take(hub, index)) != NULL) {
+            // only the newest frame is worth a coarse layer
+            if (options.mode == VIDEO_MODE_PROGRESSIVE &&
+                frame_hub_pending(hub, index)) {
+                frame_hub_release(hub, frame);
+                continue;
+            }
+
+            send_time = get_monotonic_time_us();
+            if (options.fps_max != 0 &&
+                !adaptive_rate_due(&rate,
+                                   video_sender_queue_fd(&session.sender),
+                                   send_time)) {
+                frame_hub_release(hub, frame);
+                continue;
+            }
+
+            if (send_video_frame(&session, &options, frame) == -1) {
+                log("write() failed!");
+                err = true;
+            } else {
+                session.frame_sent = true;
+                __sync_fetch_and_add(&s_video_stats.sent, 1);
+            }
+            frame_hub_release(hub, frame);
+
+            if (options.fps_max != 0) {
+                adaptive_rate_sent(&rate,
+                                   video_sender_queue_fd(&session.sender),
+                                   get_monotonic_time_us() - send_time,
+                                   session.sender.udp_cut);
+            }
+            frame_hub_set_fps(hub, index,
+                              options.fps_max != 0 ? rate.fps : 0);
+        }
+    }
+
+#ifdef DEBUG
+    capture_end_time = get_current_time();
+    log("time = %f", (capture_end_time - capture_start_time) / 1000.0);
+#endif
+
+    frame_hub_unsubscribe(hub, index);
+    video_session_destroy(&session);
+
+    return NULL;
+}
+
+typedef struct {
+    unsigned int pixels;
+    unsigned int under;
+    unsigned int over;
+    unsigned int sum;
+    unsigned char min;
+    unsigned char max;
+    unsigned int histogram[ANALYTICS_BINS];
+} LumaStats;
+
+typedef struct {
+    unsigned int u_sum;
+    unsigned int v_sum;
+    unsigned char u_min, u_max;
+    unsigned char v_min, v_max;
+} ChromaStats;
+
+typedef struct {
+    int under_level;
+    int over_level;
+    bool chroma;
+} AnalyticsOptions;
+
+static void parse_analytics_option(void *arg, const char *line)
+{
+    AnalyticsOptions *options = (AnalyticsOptions *)arg;
+    int under, over;
+
+    if (strcmp("uv=on", line) == 0) {
+        options->chroma = true;
+    } else if (strcmp("uv=off", line) == 0) {
+        options->chroma = false;
+    } else if (strncmp("clip=", line, 5) == 0) {
+        if (sscanf(line + 5, "%d,%d", &under, &over) == 2 &&
+            under >= 0 && over <= 255 && under < over) {
+            options->under_level = under;
+            options->over_level = over;
+        } else {
+            log("invalid clip levels = %s", line + 5);
+        }
+    } else {
+        log("unknown analytics option = %s", line);
+    }
+}
+
+// Counts the samples <= under and >= over, and the sum, minimum and maximum
+// of size luma samples.
+static void measure_luma(const unsigned char *y, size_t size, int under,
+                         int over, LumaStats *stats)
+{
+    unsigned int under_count = 0, over_count = 0, sum = 0;
+    unsigned char min = 0xff, max = 0;
+    size_t i = 0;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    const uint8x16_t under_v = vdupq_n_u8(under);
+    const uint8x16_t over_v = vdupq_n_u8(over);
+    uint32x4_t under_32 = vdupq_n_u32(0);
+    uint32x4_t over_32 = vdupq_n_u32(0);
+    uint32x4_t sum_32 = vdupq_n_u32(0);
+    uint8x16_t min_v = vdupq_n_u8(0xff);
+    uint8x16_t max_v = vdupq_n_u8(0);
+    uint8x8_t half;
+    int k;
+
+    // 8 bit counters and 16 bit sums, widened every 128 vectors
+    while (i + 16 * 128 <= size) {
+        uint8x16_t under_8 = vdupq_n_u8(0);
+        uint8x16_t over_8 = vdupq_n_u8(0);
+        uint16x8_t sum_16 = vdupq_n_u16(0);
+
+        for (k = 0; k < 128; k++, i += 16) {
+            uint8x16_t v = vld1q_u8(y + i);
+
+            // the masks are 0xff, -1
+            under_8 = vsubq_u8(under_8, vcleq_u8(v, under_v));
+            over_8 = vsubq_u8(over_8, vcgeq_u8(v, over_v));
+            sum_16 = vpadalq_u8(sum_16, v);
+            min_v = vminq_u8(min_v, v);
+            max_v = vmaxq_u8(max_v, v);
+        }
+        under_32 = vpadalq_u16(under_32, vpaddlq_u8(under_8));
+        over_32 = vpadalq_u16(over_32, vpaddlq_u8(over_8));
+        sum_32 = vpadalq_u16(sum_32, sum_16);
+    }
+    under_count = vgetq_lane_u32(under_32, 0) + vgetq_lane_u32(under_32, 1)
+                  + vgetq_lane_u32(under_32, 2) + vgetq_lane_u32(under_32, 3);
+    over_count = vgetq_lane_u32(over_32, 0) + vgetq_lane_u32(over_32, 1)
+                 + vgetq_lane_u32(over_32, 2) + vgetq_lane_u32(over_32, 3);
+    sum = vgetq_lane_u32(sum_32, 0) + vgetq_lane_u32(sum_32, 1)
+          + vgetq_lane_u32(sum_32, 2) + vgetq_lane_u32(sum_32, 3);
+    half = vpmin_u8(vget_low_u8(min_v), vget_high_u8(min_v));
+    half = vpmin_u8(half, half);
+    half = vpmin_u8(half, half);
+    half = vpmin_u8(half, half);
+    min = vget_lane_u8(half, 0);
+    half = vpmax_u8(vget_low_u8(max_v), vget_high_u8(max_v));
+    half = vpmax_u8(half, half);
+    half = vpmax_u8(half, half);
+    half = vpmax_u8(half, half);
+    max = vget_lane_u8(half, 0);
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i under_v = _mm_set1_epi8((char)under);
+    const __m128i over_v = _mm_set1_epi8((char)over);
+    __m128i under_64 = zero, over_64 = zero, sum_64 = zero;
+    __m128i min_v = _mm_set1_epi8((char)0xff);
+    __m128i max_v = zero;
+    unsigned char lanes[16];
+    int k;
+
+    // 8 bit counters, widened every 255 vectors
+    while (i + 16 * 255 <= size) {
+        __m128i under_8 = zero, over_8 = zero;
+
+        for (k = 0; k < 255; k++, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(y + i));
+
+            under_8 = _mm_sub_epi8(under_8,
+                    _mm_cmpeq_epi8(_mm_min_epu8(v, under_v), v));
+            over_8 = _mm_sub_epi8(over_8,
+                    _mm_cmpeq_epi8(_mm_max_epu8(v, over_v), v));
+            sum_64 = _mm_add_epi64(sum_64, _mm_sad_epu8(v, zero));
+            min_v = _mm_min_epu8(min_v, v);
+            max_v = _mm_max_epu8(max_v, v);
+        }
+        under_64 = _mm_add_epi64(under_64, _mm_sad_epu8(under_8, zero));
+        over_64 = _mm_add_epi64(over_64, _mm_sad_epu8(over_8, zero));
+    }
+    under_count = _mm_cvtsi128_si32(under_64)
+                  + _mm_cvtsi128_si32(_mm_srli_si128(under_64, 8));
+    over_count = _mm_cvtsi128_si32(over_64)
+                 + _mm_cvtsi128_si32(_mm_srli_si128(over_64, 8));
+    sum = _mm_cvtsi128_si32(sum_64)
+          + _mm_cvtsi128_si32(_mm_srli_si128(sum_64, 8));
+    _mm_storeu_si128((__m128i *)lanes, min_v);
+    for (k = 0; k < 16; k++) {
+        min = lanes[k] < min ? lanes[k] : min;
+    }
+    _mm_storeu_si128((__m128i *)lanes, max_v);
+    for (k = 0; k < 16; k++) {
+        max = lanes[k] > max ? lanes[k] : max;
+    }
+#endif
+    for (; i < size; i++) {
+        under_count += y[i] <= under;
+        over_count += y[i] >= over;
+        sum += y[i];
+        min = y[i] < min ? y[i] : min;
+        max = y[i] > max ? y[i] : max;
+    }
+
+    stats->pixels = size;
+    stats->under = under_count;
+    stats->over = over_count;
+    stats->sum = sum;
+    stats->min = min;
+    stats->max = max;
+}
+
+// Histogram of size luma samples. Four histograms are filled in turn, so
+// consecutive samples of the same level don't wait on each other's
+// increment. NEON and SSE2 have no scatter, a vector version has to compare
+// every vector with each of the 64 bins and was 6 times slower on x86.
+static void luma_histogram(const unsigned char *y, size_t size,
+                           unsigned int histogram[ANALYTICS_BINS])
+{
+    const int shift = 8 - 6; // log2(ANALYTICS_BINS) = 6
+    unsigned int partial[4][ANALYTICS_BINS];
+    size_t i;
+    int bin;
+
+    memset(partial, 0, sizeof(partial));
+    for (i = 0; i + 4 <= size; i += 4) {
+        partial[0][y[i] >> shift]++;
+        partial[1][y[i + 1] >> shift]++;
+        partial[2][y[i + 2] >> shift]++;
+        partial[3][y[i + 3] >> shift]++;
+    }
+    for (; i < size; i++) {
+        partial[0][y[i] >> shift]++;
+    }
+
+    for (bin = 0; bin < ANALYTICS_BINS; bin++) {
+        histogram[bin] = partial[0][bin] + partial[1][bin]
+                         + partial[2][bin] + partial[3][bin];
+    }
+}
+
+// size is the number of bytes of the interleaved plane
+static void measure_chroma(const unsigned char *uv, size_t size,
+                           ChromaStats *stats)
+{
+    size_t i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->u_min = stats->v_min = 0xff;
+    // the LCD buffer has V before U
+    for (i = 0; i + 1 < size; i += 2) {
+        stats->v_sum += uv[i];
+        stats->u_sum += uv[i + 1];
+        stats->v_min = uv[i] < stats->v_min ? uv[i] : stats->v_min;
+        stats->v_max = uv[i] > stats->v_max ? uv[i] : stats->v_max;
+        stats->u_min = uv[i + 1] < stats->u_min ? uv[i + 1] : stats->u_min;
+        stats->u_max = uv[i + 1] > stats->u_max ? uv[i + 1] : stats->u_max;
+    }
+}
+
+// Packs the VIDEO_MSG_ANALYTICS message of frame into buf. Returns the size.
+static size_t encode_analytics(const VideoFrame *frame,
+                               const AnalyticsOptions *options,
+                               unsigned char *buf)
+{
+    const size_t luma_size = frame->width * frame->height;
+    LumaStats luma;
+    ChromaStats chroma;
+    unsigned char *p;
+    int bin;
+
+    // the active area is packed, so the planes are contiguous
+    measure_luma(frame->data, luma_size, options->under_level,
+                 options->over_level, &luma);
+    luma_histogram(frame->data, luma_size, luma.histogram);
+
+    p = put_video_msg_header(buf, VIDEO_MSG_ANALYTICS, frame, frame->width,
+                             frame->height, ANALYTICS_BINS,
+                             ANALYTICS_LUMA_SIZE +
+                             (options->chroma ? ANALYTICS_CHROMA_SIZE : 0));
+    p = put_u32(p, luma.pixels);
+    p = put_u32(p, luma.under);
+    p = put_u32(p, luma.over);
+    p = put_u32(p, luma.sum);
+    *p++ = luma.min;
+    *p++ = luma.max;
+    p = put_u16(p, 0);
+    for (bin = 0; bin < ANALYTICS_BINS; bin++) {
+        p = put_u32(p, luma.histogram[bin]);
+    }
+
+    if (options->chroma) {
+        measure_chroma(frame->data + luma_size, luma_size / 2, &chroma);
+        p = put_u32(p, chroma.u_sum);
+        p = put_u32(p, chroma.v_sum);
+        *p++ = chroma.u_min;
+        *p++ = chroma.u_max;
+        *p++ = chroma.v_min;
+        *p++ = chroma.v_max;
+    }
+
+    return p - buf;
+}
+
+// Exposure analytics, one per connection. Subscribes to the video capture
+// like a video client, so it also works with no video connection.
+static void *start_analytics(StreamerData *data)
+{
+    int client_fd = data->client_fd;
+    FrameHub *hub = &s_video_capture.hub;
+    AnalyticsOptions options = {
+        ANALYTICS_UNDER_LEVEL, ANALYTICS_OVER_LEVEL, false
+    };
+    OptionReader option_reader = { {0,}, 0 };
+    unsigned char buf[VIDEO_MSG_HEADER_SIZE + ANALYTICS_LUMA_SIZE +
+                      ANALYTICS_CHROMA_SIZE];
+    struct pollfd pfds[2];
+    unsigned long long events;
+    const VideoFrame *frame, *newest;
+    size_t size;
+    int index;
+
+    free(data);
+
+    pin_off_capture_cpu();
+
+    index = frame_hub_subscribe(hub, get_peer_addr(client_fd), 0, false);
+    if (index == -1) {
+        return NULL;
+    }
+
+    pfds[0].fd = client_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = hub->queues[index].event_fd;
+    pfds[1].events = POLLIN;
+    while (true) {
+        pfds[0].revents = 0;
+        pfds[1].revents = 0;
+        if (poll(pfds, 2, 100) == -1 && errno != EINTR) {
+            print_error("poll() failed");
+            break;
+        }
+
+        if (pfds[0].revents &&
+            !read_option_lines(client_fd, &option_reader, 0,
+                               parse_analytics_option, &options)) {
+            log("analytics client closed.");
+            break;
+        }
+
+        if (!pfds[1].revents) {
+            continue;
+        }
+        if (read(pfds[1].fd, &events, sizeof(events)) == -1) {
+            print_error("read() failed");
+        }
+
+        // only the newest frame is measured
+        newest = NULL;
+        while ((frame = frame_hub_take(hub, index)) != NULL) {
+            if (newest != NULL) {
+                frame_hub_release(hub, newest);
+            }
+            newest = frame;
+        }
+        if (newest == NULL) {
+            continue;
+        }
+
+        size = encode_analytics(newest, &options, buf);
+        frame_hub_release(hub, newest);
+        if (write_all(client_fd, buf, size) == -1) {
+            log("write() failed!");
+            break;
+        }
+    }
+
+    frame_hub_unsubscribe(hub, index);
+
+    return NULL;
+}
+
+typedef struct {
+    int x, y, width, height;
+} MotionRoi;
+
+// Detector state is owned by the motion thread, the settings are written by
+// the executor under lock.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool running;
+    volatile bool stop;
+    MotionRoi rois[MOTION_MAX_ROIS];
+    int num_rois;
+    int sensitivity;
+    char action[MOTION_ACTION_MAX]; // empty = no action
+    unsigned int generation; // of the settings
+    unsigned long frames;
+    unsigned long events;
+    unsigned long long detect_us;
+} MotionDetector;
+
+static MotionDetector s_motion = {
+    PTHREAD_MUTEX_INITIALIZER, 0, false, false, {{0,}}, 0,
+    MOTION_SENSITIVITY, "", 0, 0, 0, 0
+};
+
+// Marks the cells whose center is in one of the regions, or all cells if
+// there are none. Returns the number of marked cells.
+static int build_motion_mask(const MotionRoi *rois, int num_rois,
+                             int grid_width, int grid_height,
+                             unsigned char *mask)
+{
+    int x, y, i, cx, cy;
+    int count = 0;
+
+    for (y = 0; y < grid_height; y++) {
+        for (x = 0; x < grid_width; x++) {
+            cx = x * MOTION_CELL_SIZE + MOTION_CELL_SIZE / 2;
+            cy = y * MOTION_CELL_SIZE + MOTION_CELL_SIZE / 2;
+            mask[y * grid_width + x] = num_rois == 0;
+            for (i = 0; i < num_rois; i++) {
+                if (cx >= rois[i].x && cx < rois[i].x + rois[i].width &&
+                    cy >= rois[i].y && cy < rois[i].y + rois[i].height) {
+                    mask[y * grid_width + x] = 1;
+                    break;
+                }
+            }
+            count += mask[y * grid_width + x];
+        }
+    }
+
+    return count;
+}
+
+// Updates background (8.8 fixed point) with cells and returns the number of
+// masked cells that differ from it by more than level.
+static int update_motion_background(const unsigned char *cells,
+                                    unsigned short *background,
+                                    const unsigned char *mask, int count,
+                                    int level)
+{
+    int changed = 0;
+    int i, diff;
+
+    for (i = 0; i < count; i++) {
+        diff = cells[i] - (background[i] >> 8);
+        if (mask[i] && (diff > level || diff < -level)) {
+            changed++;
+        }
+        background[i] += ((cells[i] << 8) - background[i])
+                         >> MOTION_BACKGROUND_SHIFT;
+    }
+
+    return changed;
+}
+
+static void *motion_thread(void *thread_data)
+{
+    MotionDetector *motion = (MotionDetector *)thread_data;
+    FrameHub *hub = &s_video_capture.hub;
+    unsigned char cells[MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT];
+    unsigned short background[MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT];
+    unsigned char mask[MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT];
+    int grid_width = 0, grid_height = 0;
+    unsigned int generation = 0;
+    int mask_count = 0;
+    int level = 0, min_changed = 1;
+    int warmup = 0;
+    char action[MOTION_ACTION_MAX] = "";
+    FILE *injector = NULL;
+    struct pollfd pfd;
+    unsigned long long events;
+    const VideoFrame *frame, *newest;
+    long long now, start_time, last_motion_time = 0;
+    int index, changed, i;
+
+    pin_off_capture_cpu();
+
+    // keeps the capture going with no video connection, on the Y plane
+    index = frame_hub_subscribe(hub, INADDR_NONE, MOTION_FPS, true);
+    if (index == -1) {
+        return NULL;
+    }
+
+    pfd.fd = hub->queues[index].event_fd;
+    pfd.events = POLLIN;
+    while (!motion->stop) {
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) == -1 && errno != EINTR) {
+            print_error("poll() failed");
+            break;
+        }
+
+        now = get_monotonic_time_us() / 1000;
+        if (s_motion_active && now - last_motion_time > MOTION_HOLD_MS) {
+            s_motion_active = false;
+        }
+
+        if (!pfd.revents) {
+            continue;
+        }
+        if (read(pfd.fd, &events, sizeof(events)) == -1) {
+            print_error("read() failed");
+        }
+
+        newest = NULL;
+        while ((frame = frame_hub_take(hub, index)) != NULL) {
+            if (newest != NULL) {
+                frame_hub_release(hub, newest);
+            }
+            newest = frame;
+        }
+        if (newest == NULL) {
+            continue;
+        }
+
+        start_time = get_monotonic_time_us();
+        if (newest->width / MOTION_CELL_SIZE != grid_width ||
+            newest->height / MOTION_CELL_SIZE != grid_height) {
+            grid_width = newest->width / MOTION_CELL_SIZE;
+            grid_height = newest->height / MOTION_CELL_SIZE;
+            generation = motion->generation - 1;
+            warmup = 0;
+        }
+        downscale_plane_box(newest->data, newest->width, newest->height,
+                            newest->width, cells, grid_width, grid_height,
+                            grid_width, 1);
+        frame_hub_release(hub, newest);
+
+        if (generation != motion->generation) {
+            pthread_mutex_lock(&motion->lock);
+            generation = motion->generation;
+            mask_count = build_motion_mask(motion->rois, motion->num_rois,
+                                           grid_width, grid_height, mask);
+            // 1: 48 levels on 1% of the cells, 100: 8 levels on one cell
+            level = 8 + (100 - motion->sensitivity) * 40 / 100;
+            min_changed = mask_count * (100 - motion->sensitivity) / 10000;
+            if (min_changed < 1) {
+                min_changed = 1;
+            }
+            strcpy(action, motion->action);
+            pthread_mutex_unlock(&motion->lock);
+        }
+
+        if (warmup == 0) {
+            for (i = 0; i < grid_width * grid_height; i++) {
+                background[i] = cells[i] << 8;
+            }
+        }
+        changed = update_motion_background(cells, background, mask,
+                                           grid_width * grid_height, level);
+        motion->frames++;
+        motion->detect_us += get_monotonic_time_us() - start_time;
+        if (warmup < MOTION_WARMUP_FRAMES) {
+            warmup++;
+            continue;
+        }
+
+        if (changed >= min_changed) {
+            last_motion_time = now;
+            if (!s_motion_active) {
+                s_motion_active = true;
+                motion->events++;
+                log("motion, %d cells changed.", changed);
+
+                if (action[0] != '\0' && injector == NULL) {
+                    injector = popen(NX_INPUT_INJECTOR_COMMAND, "w");
+                    if (injector == NULL) {
+                        print_error("popen() failed");
+                    }
+                }
+                if (action[0] != '\0' && injector != NULL) {
+                    fprintf(injector, "%s\n", action);
+                    fflush(injector);
+                }
+            }
+        }
+    }
+
+    s_motion_active = false;
+    if (injector != NULL && pclose(injector) == -1) {
+        //print_error("pclose() failed");
+    }
+    frame_hub_unsubscribe(hub, index);
+
+    return NULL;
+}
+
+// "motion=", "motion_roi=", "motion_sensitivity=" and "motion_action="
+// executor commands.
+static void set_motion_option(MotionDetector *motion, const char *command)
+{
+    MotionRoi roi;
+    int sensitivity;
+
+    pthread_mutex_lock(&motion->lock);
+    if (strcmp("motion=on", command) == 0) {
+        if (!motion->running) {
+            motion->stop = false;
+            if (pthread_create(&motion->thread, NULL, motion_thread,
+                               motion)) {
+                print_error("pthread_create() failed");
+            } else {
+                motion->running = true;
+            }
+        }
+    } else if (strcmp("motion=off", command) == 0) {
+        if (motion->running) {
+            motion->stop = true;
+            pthread_mutex_unlock(&motion->lock);
+            if (pthread_join(motion->thread, NULL)) {
+                print_error("pthread_join() failed");
+            }
+            pthread_mutex_lock(&motion->lock);
+            motion->running = false;
+        }
+    } else if (strcmp("motion_roi=off", command) == 0) {
+        motion->num_rois = 0;
+    } else if (strncmp("motion_roi=", command, 11) == 0) {
+        if (sscanf(command + 11, "%d,%d,%d,%d", &roi.x, &roi.y, &roi.width,
+                   &roi.height) == 4 && roi.width > 0 && roi.height > 0 &&
+            motion->num_rois < MOTION_MAX_ROIS) {
+            motion->rois[motion->num_rois++] = roi;
+        } else {
+            log("invalid or too many motion rois = %s", command + 11);
+        }
+    } else if (strncmp("motion_sensitivity=", command, 19) == 0) {
+        sensitivity = atoi(command + 19);
+        if (sensitivity >= 1 && sensitivity <= 100) {
+            motion->sensitivity = sensitivity;
+        }
+    } else if (strcmp("motion_action=off", command) == 0) {
+        motion->action[0] = '\0';
+    } else if (strncmp("motion_action=", command, 14) == 0) {
+        strncpy(motion->action, command + 14, sizeof(motion->action) - 1);
+        motion->action[sizeof(motion->action) - 1] = '\0';
+    }
+    motion->generation++;
+    pthread_mutex_unlock(&motion->lock);
+}
+
+static int s_xwin_fps;
+static int s_xwin_fps_min;
+static int s_xwin_fps_max; // adaptive frame rate if set
+
+// The OSD capture, shared by all xwin connections. Each frame is the
+// XWIN_FRAME_SIZE bytes of BGRA pixels of the root window, from one
+// "xwd -root" dump per frame. With USE_XSHM and the "xgrab=xshm" executor
+// command, the root window is read into a shared memory image by the X
+// server instead, falling back to xwd if that fails. xwd stays the default
+// until bench_xwin.c has numbers from the camera; the grabber is chosen
+// when the capture starts.
+// With USE_XDAMAGE, the image is kept up to date by reading back only the
+// damaged rectangles, and a frame is published only if there were any.
+// segment_seqs has the seq of the last frame in which each segment may have
+// changed, so the connections hash only those.
+typedef struct {
+    FrameHub hub;
+    pthread_t thread;
+    volatile bool stop;
+#ifdef USE_XSHM
+    Display *display; // NULL if xwd is used
+    XImage *image;
+    XShmSegmentInfo shm;
+#endif
+#ifdef USE_XDAMAGE
+    Damage damage; // 0 if not used
+    XserverRegion region;
+    int damage_event;
+    bool damage_all;     // the whole image must be read
+    bool unpublished;    // damage read but not published for lack of a frame
+    int num_subscribers; // a new one gets a frame without damage
+#endif
+    volatile unsigned int segment_seqs[XWIN_NUM_SEGMENTS];
+    const char *grabber;
+    unsigned long grabs;
+    unsigned long long grab_us;
+    unsigned long damage_rects;
+    unsigned long long damage_pixels;
+    unsigned long idle_ticks; // without damage
+    unsigned long rect_frames; // XWIN_MODE_RECT, all connections
+    unsigned long rects;
+    unsigned long long rect_bytes;
+    unsigned long segments; // XWIN_MODE_SEGMENT, all connections
+    unsigned long rle_segments;
+    unsigned long long segment_bytes;
+    unsigned long long segment_raw_bytes; // the same segments unencoded
+    unsigned long long rle_us;
+} XwinCapture;
+
+static XwinCapture s_xwin_capture = { .grabber = "xwd" };
+static volatile bool s_xwin_xshm; // "xgrab=xshm|xwd"
+
+// Records frame seq as the last change of the segments in the rectangle.
+static void mark_xwin_segments(XwinCapture *capture, int x, int y,
+                               int width, int height, unsigned int seq)
+{
+    int first, last;
+    int row, i;
+
+    for (row = y; row < y + height; row++) {
+        first = (row * FRAME_WIDTH + x) / XWIN_SEGMENT_PIXELS;
+        last = (row * FRAME_WIDTH + x + width - 1) / XWIN_SEGMENT_PIXELS;
+        for (i = first; i <= last; i++) {
+            capture->segment_seqs[i] = seq;
+        }
+    }
+}
+
+#ifdef USE_XSHM
+static volatile int s_xshm_error;
+
+// The default handler exits the process.
+static int handle_xshm_error(Display *display, XErrorEvent *event)
+{
+    (void)display;
+    s_xshm_error = event->error_code;
+    return 0;
+}
+
+#ifdef USE_XDAMAGE
+static void xdamage_close(XwinCapture *capture)
+{
+    if (capture->damage == 0) {
+        return;
+    }
+
+    XFixesDestroyRegion(capture->display, capture->region);
+    XDamageDestroy(capture->display, capture->damage);
+    capture->damage = 0;
+}
+#endif
+
+static void xshm_close(XwinCapture *capture)
+{
+    if (capture->display == NULL) {
+        return;
+    }
+
+#ifdef USE_XDAMAGE
+    xdamage_close(capture);
+#endif
+    XShmDetach(capture->display, &capture->shm);
+    capture->image->data = NULL; // not malloc()ed
+    XDestroyImage(capture->image);
+    if (shmdt(capture->shm.shmaddr) == -1) {
+        print_error("shmdt() failed");
+    }
+    XCloseDisplay(capture->display);
+    capture->display = NULL;
+    capture->grabber = "xwd";
+}
+
+// Attaches a FRAME_WIDTH x FRAME_HEIGHT 32 bpp shared memory image for the
+// root window. Returns false if the X server can't do it.
+static bool xshm_open(XwinCapture *capture)
+{
+    Display *display;
+    XImage *image;
+    int screen;
+
+    display = XOpenDisplay(NULL);
+    if (display == NULL) {
+        log("XOpenDisplay() failed");
+        return false;
+    }
+    if (!XShmQueryExtension(display)) {
+        log("no MIT-SHM");
+        goto error_display;
+    }
+
+    screen = DefaultScreen(display);
+    image = XShmCreateImage(display, DefaultVisual(display, screen),
+                            DefaultDepth(display, screen), ZPixmap, NULL,
+                            &capture->shm, FRAME_WIDTH, FRAME_HEIGHT);
+    if (image == NULL) {
+        log("XShmCreateImage() failed");
+        goto error_display;
+    }
+    if (image->bits_per_pixel != 32) {
+        log("bits_per_pixel = %d", image->bits_per_pixel);
+        goto error_image;
+    }
+
+    capture->shm.shmid = shmget(IPC_PRIVATE,
+                                image->bytes_per_line * image->height,
+                                IPC_CREAT | 0600);
+    if (capture->shm.shmid == -1) {
+        print_error("shmget() failed");
+        goto error_image;
+    }
+    capture->shm.shmaddr = shmat(capture->shm.shmid, NULL, 0);
+    // removed when both sides have detached it
+    shmctl(capture->shm.shmid, IPC_RMID, NULL);
+    if (capture->shm.shmaddr == (void *)-1) {
+        print_error("shmat() failed");
+        goto error_image;
+    }
+    image->data = capture->shm.shmaddr;
+    capture->shm.readOnly = False;
+
+    s_xshm_error = 0;
+    XSetErrorHandler(handle_xshm_error);
+    if (XShmAttach(display, &capture->shm)) {
+        XSync(display, False); // errors are asynchronous
+    }
+    if (s_xshm_error != 0) {
+        log("XShmAttach() failed, error = %d", s_xshm_error);
+        goto error_shm;
+    }
+
+    capture->display = display;
+    capture->image = image;
+    capture->grabber = "xshm";
+    return true;
+
+error_shm:
+    shmdt(capture->shm.shmaddr);
+error_image:
+    image->data = NULL;
+    XDestroyImage(image);
+error_display:
+    XCloseDisplay(display);
+    return false;
+}
+
+static void copy_xshm_image(const XImage *image, unsigned char *data)
+{
+    int y;
+
+    // ZPixmap of a little endian server is BGRA, as dumped by xwd
+    if (image->bytes_per_line == FRAME_WIDTH * 4) {
+        memcpy(data, image->data, XWIN_FRAME_SIZE);
+    } else {
+        for (y = 0; y < FRAME_HEIGHT; y++) {
+            memcpy(data + y * FRAME_WIDTH * 4,
+                   image->data + y * image->bytes_per_line, FRAME_WIDTH * 4);
+        }
+    }
+}
+
+// Returns false if the X server didn't fill the image.
+static bool grab_xshm_frame(XwinCapture *capture, unsigned char *data)
+{
+    if (!XShmGetImage(capture->display, DefaultRootWindow(capture->display),
+                      capture->image, 0, 0, AllPlanes)) {
+        return false;
+    }
+    copy_xshm_image(capture->image, data);
+
+    return true;
+}
+#endif
+
+#ifdef USE_XDAMAGE
+// Damage larger than this is read back with one XShmGetImage().
+#define XWIN_DAMAGE_MAX_RECT_AREA (FRAME_WIDTH * FRAME_HEIGHT / 4)
+
+// Subscribes to the damage of the root window. Returns false if the X
+// server can't report it, every tick is a full grab then.
+static bool xdamage_open(XwinCapture *capture)
+{
+    Display *display = capture->display;
+    int fixes_event, error_base;
+
+    if (!XDamageQueryExtension(display, &capture->damage_event,
+                               &error_base) ||
+        !XFixesQueryExtension(display, &fixes_event, &error_base)) {
+        log("no DAMAGE or XFIXES");
+        return false;
+    }
+
+    capture->damage = XDamageCreate(display, DefaultRootWindow(display),
+                                    XDamageReportNonEmpty);
+    capture->region = XFixesCreateRegion(display, NULL, 0);
+    capture->damage_all = true;
+    capture->unpublished = false;
+    capture->num_subscribers = 0;
+    capture->grabber = "xdamage";
+
+    return true;
+}
+
+// Reads the damage since the last call into the image and marks its
+// segments with seq. Returns the number of damaged pixels, or -1 if the
+// image can't be read.
+static int read_xdamage(XwinCapture *capture, unsigned int seq)
+{
+    Display *display = capture->display;
+    Window root = DefaultRootWindow(display);
+    XEvent event;
+    XRectangle *rects;
+    int count, area = 0;
+    int x, y, width, height, i;
+    bool damaged = capture->damage_all;
+    long long start;
+
+    // one XDamageNotify until the damage is subtracted
+    while (XPending(display)) {
+        XNextEvent(display, &event);
+        if (event.type == capture->damage_event + XDamageNotify) {
+            damaged = true;
+        }
+    }
+    if (!damaged) {
+        return 0;
+    }
+
+    start = get_monotonic_time_us();
+    XDamageSubtract(display, capture->damage, None, capture->region);
+    rects = XFixesFetchRegion(display, capture->region, &count);
+    for (i = 0; i < count; i++) {
+        area += rects[i].width * rects[i].height;
+    }
+
+    if (capture->damage_all || area > XWIN_DAMAGE_MAX_RECT_AREA) {
+        if (!XShmGetImage(display, root, capture->image, 0, 0, AllPlanes)) {
+            goto error;
+        }
+        if (capture->damage_all) {
+            mark_xwin_segments(capture, 0, 0, FRAME_WIDTH, FRAME_HEIGHT,
+                               seq);
+            area = FRAME_WIDTH * FRAME_HEIGHT;
+            capture->damage_all = false;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        x = rects[i].x > 0 ? rects[i].x : 0;
+        y = rects[i].y > 0 ? rects[i].y : 0;
+        width = rects[i].x + rects[i].width;
+        width = (width < FRAME_WIDTH ? width : FRAME_WIDTH) - x;
+        height = rects[i].y + rects[i].height;
+        height = (height < FRAME_HEIGHT ? height : FRAME_HEIGHT) - y;
+        if (width <= 0 || height <= 0) {
+            continue;
+        }
+
+        // XGetSubImage() converts pixel by pixel, fine for small ones
+        if (area <= XWIN_DAMAGE_MAX_RECT_AREA &&
+            XGetSubImage(display, root, x, y, width, height, AllPlanes,
+                         ZPixmap, capture->image, x, y) == NULL) {
+            goto error;
+        }
+        mark_xwin_segments(capture, x, y, width, height, seq);
+    }
+
+    capture->grabs++;
+    capture->grab_us += get_monotonic_time_us() - start;
+    capture->damage_rects += count;
+    capture->damage_pixels += area;
+    if (rects != NULL) {
+        XFree(rects);
+    }
+    return area;
+
+error:
+    if (rects != NULL) {
+        XFree(rects);
+    }
+    return -1;
+}
+
+// Returns true if a frame should be published: the image is damaged, or a
+// connection needs a first frame. If damage is not used, every tick grabs.
+static bool xwin_damaged(XwinCapture *capture, unsigned int seq)
+{
+    int num_subscribers;
+    int area;
+
+    if (capture->damage == 0) {
+        return true;
+    }
+
+    area = read_xdamage(capture, seq);
+    if (area == -1) {
+        log("damage read back failed, error = %d, using xwd", s_xshm_error);
+        xshm_close(capture);
+        return true;
+    }
+
+    num_subscribers = capture->hub.num_subscribers;
+    if (area > 0 || capture->unpublished ||
+        num_subscribers > capture->num_subscribers) {
+        capture->num_subscribers = num_subscribers;
+        return true;
+    }
+    capture->num_subscribers = num_subscribers;
+    capture->idle_ticks++;
+
+    return false;
+}
+#endif
+
+// Returns false if the dump is short.
+static bool grab_xwd_frame(unsigned char *data)
+{
+    FILE *xwd_out;
+    size_t skip_size, read_size, offset;
+    bool ok = true;
+
+    xwd_out = popen("xwd -root", "r");
+    if (xwd_out == NULL) {
+        print_error("popen() failed");
+        return false;
+    }
+
+    // the header is read into data too, the pixels overwrite it
+    skip_size = XWD_SKIP_BYTES;
+    while (skip_size != 0) {
+        read_size = fread(data, 1, skip_size, xwd_out);
+        if (read_size == 0) {
+            log("xwd read_size = 0");
+            ok = false;
+            break;
+        }
+        skip_size -= read_size;
+    }
+
+    for (offset = 0; ok && offset < XWIN_FRAME_SIZE; offset += read_size) {
+        read_size = fread(data + offset, 1, XWIN_FRAME_SIZE - offset, xwd_out);
+        if (read_size == 0) {
+            log("read_size == 0, offset = %u", (unsigned int)offset);
+            ok = false;
+        }
+    }
+
+    if (pclose(xwd_out) == -1) {
+        //print_error("pclose() failed");
+    }
+
+    return ok;
+}
+
+// Grabs frame seq into data.
+static bool grab_xwin_frame(XwinCapture *capture, unsigned char *data,
+                            unsigned int seq)
+{
+    long long start = get_monotonic_time_us();
+    bool ok;
+
+#ifdef USE_XDAMAGE
+    if (capture->damage != 0) {
+        // already read by xwin_damaged()
+        copy_xshm_image(capture->image, data);
+        return true;
+    }
+#endif
+#ifdef USE_XSHM
+    if (capture->display != NULL) {
+        if (grab_xshm_frame(capture, data)) {
+            ok = true;
+            goto done;
+        }
+        log("XShmGetImage() failed, error = %d, using xwd", s_xshm_error);
+        xshm_close(capture);
+    }
+#endif
+    ok = grab_xwd_frame(data);
+
+#ifdef USE_XSHM
+done:
+#endif
+    if (ok) {
+        mark_xwin_segments(capture, 0, 0, FRAME_WIDTH, FRAME_HEIGHT, seq);
+        capture->grabs++;
+        capture->grab_us += get_monotonic_time_us() - start;
+    }
+    return ok;
+}
+
+// Grabs the root window once per tick for all xwin connections.
+static void *xwin_capture_thread(void *thread_data)
+{
+    XwinCapture *capture = (XwinCapture *)thread_data;
+    VideoFrame *frame;
+    unsigned int seq = 1; // 0 in segment_seqs is before the first frame
+    int i;
+
+    for (i = 0; i < XWIN_NUM_SEGMENTS; i++) {
+        capture->segment_seqs[i] = 0;
+    }
+
+#ifdef USE_XSHM
+    if (s_xwin_xshm && !xshm_open(capture)) {
+        log("MIT-SHM is not available, using xwd");
+    }
+#endif
+#ifdef USE_XDAMAGE
+    if (capture->display != NULL && !xdamage_open(capture)) {
+        log("DAMAGE is not available, grabbing every tick");
+    }
+#endif
+
+    pacer_reset(&s_xwin_pacer);
+    while (!capture->stop) {
+#ifdef USE_XDAMAGE
+        if (!xwin_damaged(capture, seq)) {
+            pacer_wait(&s_xwin_pacer,
+                       frame_hub_max_fps(&capture->hub, s_xwin_fps));
+            continue;
+        }
+#endif
+        frame = frame_hub_get_free(&capture->hub);
+        if (frame != NULL && grab_xwin_frame(capture, frame->data, seq)) {
+            frame->seq = seq++;
+            frame->timestamp = get_monotonic_time_us();
+            frame->buffer_index = 0;
+            frame->width = FRAME_WIDTH;
+            frame->height = FRAME_HEIGHT;
+            frame_hub_publish(&capture->hub, frame);
+        } else if (frame != NULL) {
+            frame_hub_release(&capture->hub, frame);
+        }
+#ifdef USE_XDAMAGE
+        capture->unpublished = frame == NULL;
+#endif
+
+        pacer_wait(&s_xwin_pacer,
+                   frame_hub_max_fps(&capture->hub, s_xwin_fps));
+    }
+
+#ifdef USE_XSHM
+    xshm_close(capture);
+#endif
+
+    return NULL;
+}
+
+static bool xwin_capture_start(void *owner)
+{
+    XwinCapture *capture = (XwinCapture *)owner;
+
+    capture->stop = false;
+    if (pthread_create(&capture->thread, NULL, xwin_capture_thread,
+                       capture)) {
+        print_error("pthread_create() failed");
+        return false;
+    }
+
+    return true;
+}
+
+static void xwin_capture_stop(void *owner)
+{
+    XwinCapture *capture = (XwinCapture *)owner;
+
+    capture->stop = true;
+    if (pthread_join(capture->thread, NULL)) {
+        print_error("pthread_join() failed");
+    }
+}
+
+// Returns the number of BGRA pixels from p that are equal to the first,
+// at most n.
+static int xwin_run_length(const unsigned char *p, int n)
+{
+    // the bytes of p[0..3] in memory, as for vector loads
+    const unsigned int pixel = p[0] | p[1] << 8 | p[2] << 16 |
+                               (unsigned int)p[3] << 24;
+    int i = 1;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    const uint32x4_t first = vdupq_n_u32(pixel);
+
+    for (; i + 4 <= n; i += 4) {
+        uint32x4_t eq = vceqq_u32(vreinterpretq_u32_u8(vld1q_u8(p + i * 4)),
+                                  first);
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u16(vmovn_u32(eq)), 0);
+
+        if (bits != ~0ULL) {
+            return i + __builtin_ctzll(~bits) / 16;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i first = _mm_set1_epi32((int)pixel);
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 4));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(v, first));
+
+        if (mask != 0xffff) {
+            return i + __builtin_ctz(~mask) / 4;
+        }
+    }
+#endif
+    for (; i < n && memcmp(p + i * 4, p, 4) == 0; i++) {
+    }
+
+    return i;
+}
+
+// Returns the number of BGRA pixels from p before the first two equal
+// neighbours, at most n.
+static int xwin_literal_length(const unsigned char *p, int n)
+{
+    int i = 0;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; i + 5 <= n; i += 4) {
+        uint32x4_t eq = vceqq_u32(
+                vreinterpretq_u32_u8(vld1q_u8(p + i * 4)),
+                vreinterpretq_u32_u8(vld1q_u8(p + i * 4 + 4)));
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u16(vmovn_u32(eq)), 0);
+
+        if (bits != 0) {
+            return i + __builtin_ctzll(bits) / 16;
+        }
+    }
+#elif defined(__SSE2__)
+    for (; i + 5 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 4));
+        __m128i next = _mm_loadu_si128((const __m128i *)(p + i * 4 + 4));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(v, next));
+
+        if (mask != 0) {
+            return i + __builtin_ctz(mask) / 4;
+        }
+    }
+#endif
+    for (; i + 1 < n; i++) {
+        if (memcmp(p + i * 4, p + i * 4 + 4, 4) == 0) {
+            return i;
+        }
+    }
+
+    return n;
+}
+
+// Encodes n BGRA pixels as XWIN_ENCODING_RLE runs into dst. Returns the
+// size, or 0 if it would be more than max.
+static size_t rle_encode_pixels(const unsigned char *src, int n,
+                                unsigned char *dst, size_t max)
+{
+    static const unsigned char transparent[4];
+    unsigned char *p = dst;
+    const unsigned char *end = dst + max;
+    int i = 0, len, chunk;
+    bool solid;
+
+    while (i < n) {
+        len = xwin_run_length(src + i * 4, n - i);
+        if (len >= 2) {
+            solid = memcmp(src + i * 4, transparent, 4) != 0;
+            for (; len > 0; len -= chunk, i += chunk) {
+                chunk = len < XWIN_RLE_MAX_RUN ? len : XWIN_RLE_MAX_RUN;
+                if (end - p < (solid ? 5 : 1)) {
+                    return 0;
+                }
+                *p++ = (solid ? 0xc0 : 0x80) | (chunk - 1);
+                if (solid) {
+                    memcpy(p, src + i * 4, 4);
+                    p += 4;
+                }
+            }
+            continue;
+        }
+
+        len = xwin_literal_length(src + i * 4, n - i);
+        for (; len > 0; len -= chunk, i += chunk) {
+            chunk = len < XWIN_RLE_MAX_LITERAL ? len : XWIN_RLE_MAX_LITERAL;
+            if (end - p < 1 + chunk * 4) {
+                return 0;
+            }
+            *p++ = chunk - 1;
+            memcpy(p, src + i * 4, chunk * 4);
+            p += chunk * 4;
+        }
+    }
+
+    return p - dst;
+}
+
+// Sends the segments of frame whose hash changed since the last frame of
+// this connection (all of them for the first one), then the end of frame
+// marker. Each segment has its own fingerprint of all BGRA bytes. Segments
+// not changed since frame last_seq, as told by segment_seqs, are not
+// hashed again; last_seq 0 hashes all. Returns false if the client is gone.
+static bool send_xwin_frame(int client_fd, const unsigned char *frame,
+                            unsigned int *hashs, int count,
+                            const volatile unsigned int *segment_seqs,
+                            unsigned int last_seq, int encoding)
+{
+    const unsigned char *segment;
+    unsigned char buf[XWIN_OUT_BUF_SIZE];
+    unsigned char *p = buf;
+    unsigned int hash;
+    int hash_index, skip_count = 0;
+    size_t size;
+    int segments = 0, rle_segments = 0;
+    unsigned long long raw_bytes = 0, bytes = 0;
+    long long rle_start, rle_us = 0;
+
+    for (hash_index = 0; hash_index < XWIN_NUM_SEGMENTS; hash_index++) {
+        segment = frame + hash_index * (XWIN_BUF_SIZE - 2);
+        if (last_seq != 0 && segment_seqs[hash_index] <= last_seq) {
+            skip_count++;
+            continue;
+        }
+        hash = fingerprint(segment, XWIN_BUF_SIZE - 2,
+                           FINGERPRINT_BLOCK_SIZE);
+
+        if (count != 0 && hashs[hash_index] == hash) {
+            skip_count++;
+            continue;
+        }
+        hashs[hash_index] = hash;
+
+        if (buf + sizeof(buf) - p < XWIN_BUF_SIZE) {
+            if (write_all(client_fd, buf, p - buf) == -1) {
+                log("write() failed");
+                return false;
+            }
+            p = buf;
+        }
+
+        // the runs must be smaller than the raw segment with its header
+        size = 0;
+        if (encoding == XWIN_ENCODING_RLE) {
+            rle_start = get_monotonic_time_us();
+            size = rle_encode_pixels(segment, XWIN_SEGMENT_PIXELS,
+                                     p + XWIN_RLE_HEADER_SIZE,
+                                     XWIN_BUF_SIZE - XWIN_RLE_HEADER_SIZE - 1);
+            rle_us += get_monotonic_time_us() - rle_start;
+        }
+        if (size != 0) {
+            p = put_u16(p, hash_index | XWIN_RLE_FLAG);
+            p = put_u16(p, size);
+            p += size;
+            bytes += XWIN_RLE_HEADER_SIZE + size;
+            rle_segments++;
+        } else {
+            p = put_u16(p, hash_index);
+            memcpy(p, segment, XWIN_BUF_SIZE - 2);
+            p += XWIN_BUF_SIZE - 2;
+            bytes += XWIN_BUF_SIZE;
+        }
+        raw_bytes += XWIN_BUF_SIZE;
+        segments++;
+    }
+
+    // notify end of frame
+    if (buf + sizeof(buf) - p < XWIN_BUF_SIZE) {
+        if (write_all(client_fd, buf, p - buf) == -1) {
+            log("write() failed");
+            return false;
+        }
+        p = buf;
+    }
+    p = put_u16(p, 0x0fff);
+    memcpy(p, frame + XWIN_FRAME_SIZE - (XWIN_BUF_SIZE - 2),
+           XWIN_BUF_SIZE - 2);
+    p += XWIN_BUF_SIZE - 2;
+    if (write_all(client_fd, buf, p - buf) == -1) {
+        log("write() failed");
+        return false;
+    }
+
+    __sync_fetch_and_add(&s_xwin_capture.segments, segments);
+    __sync_fetch_and_add(&s_xwin_capture.rle_segments, rle_segments);
+    __sync_fetch_and_add(&s_xwin_capture.segment_bytes, bytes);
+    __sync_fetch_and_add(&s_xwin_capture.segment_raw_bytes, raw_bytes);
+    __sync_fetch_and_add(&s_xwin_capture.rle_us, rle_us);
+
+    if (skip_count != XWIN_NUM_SEGMENTS) {
+        log("[XWinCapture] count = %d, skip_count = %d", count, skip_count);
+    }
+
+    return true;
+}
+
+typedef struct {
+    int mode;
+    bool mode_locked; // after the first frame
+    int encoding;     // XWIN_MODE_SEGMENT, can be changed any time
+} XwinOptions;
+
+static void parse_xwin_option(void *arg, const char *line)
+{
+    XwinOptions *options = (XwinOptions *)arg;
+    int mode;
+
+    if (strncmp("mode=", line, 5) == 0) {
+        if (strcmp(line + 5, "segment") == 0) {
+            mode = XWIN_MODE_SEGMENT;
+        } else if (strcmp(line + 5, "rect") == 0) {
+            mode = XWIN_MODE_RECT;
+        } else {
+            log("unknown xwin mode = %s", line + 5);
+            return;
+        }
+        if (options->mode_locked) {
+            log("xwin mode can't be changed after the first frame.");
+            return;
+        }
+        options->mode = mode;
+    } else if (strcmp("encoding=raw", line) == 0) {
+        options->encoding = XWIN_ENCODING_RAW;
+    } else if (strcmp("encoding=rle", line) == 0) {
+        options->encoding = XWIN_ENCODING_RLE;
+    } else {
+        log("unknown xwin option = %s", line);
+    }
+}
+
+typedef struct {
+    int x; // in tiles
+    int y;
+    int width;
+    int height;
+} XwinRect;
+
+// XWIN_MODE_RECT state of one connection
+typedef struct {
+    unsigned int hashs[XWIN_NUM_TILES];
+    unsigned char dirty[XWIN_NUM_TILES];
+    XwinRect rects[XWIN_NUM_TILES];
+    unsigned char buf[XWIN_RECT_BUF_SIZE];
+} XwinRectSession;
+
+// Marks the tiles that may have changed since frame last_seq, as told by
+// segment_seqs, with 1. last_seq 0 marks all.
+static void mark_xwin_tiles(unsigned char *dirty,
+                            const volatile unsigned int *segment_seqs,
+                            unsigned int last_seq)
+{
+    int segment, pixel, last_pixel;
+    int row, x, last_x, tile;
+
+    if (last_seq == 0) {
+        memset(dirty, 1, XWIN_NUM_TILES);
+        return;
+    }
+
+    memset(dirty, 0, XWIN_NUM_TILES);
+    for (segment = 0; segment < XWIN_NUM_SEGMENTS; segment++) {
+        if (segment_seqs[segment] <= last_seq) {
+            continue;
+        }
+        // a segment is at most two rows
+        pixel = segment * XWIN_SEGMENT_PIXELS;
+        last_pixel = pixel + XWIN_SEGMENT_PIXELS - 1;
+        for (row = pixel / FRAME_WIDTH; row <= last_pixel / FRAME_WIDTH;
+             row++) {
+            x = row == pixel / FRAME_WIDTH ? pixel % FRAME_WIDTH : 0;
+            last_x = row == last_pixel / FRAME_WIDTH ?
+                     last_pixel % FRAME_WIDTH : FRAME_WIDTH - 1;
+            tile = row / XWIN_TILE_SIZE * XWIN_TILES_X;
+            memset(dirty + tile + x / XWIN_TILE_SIZE, 1,
+                   last_x / XWIN_TILE_SIZE - x / XWIN_TILE_SIZE + 1);
+        }
+    }
+}
+
+// Hashes the marked tiles of frame and keeps only the changed ones marked.
+// Returns the number of changed tiles.
+static int find_dirty_tiles(XwinRectSession *session,
+                            const unsigned char *frame, bool first)
+{
+    const unsigned char *p;
+    unsigned int hash;
+    int tile, count = 0;
+
+    for (tile = 0; tile < XWIN_NUM_TILES; tile++) {
+        if (!session->dirty[tile]) {
+            continue;
+        }
+        // one FINGERPRINT_BLOCK_SIZE block is one row of a tile
+        p = frame + (tile / XWIN_TILES_X * XWIN_TILE_SIZE * FRAME_WIDTH +
+                     tile % XWIN_TILES_X * XWIN_TILE_SIZE) * 4;
+        hash = fingerprint(p, XWIN_TILE_SIZE * FRAME_WIDTH * 4,
+                           FRAME_WIDTH * 4);
+        if (!first && session->hashs[tile] == hash) {
+            session->dirty[tile] = 0;
+            continue;
+        }
+        session->hashs[tile] = hash;
+        count++;
+    }
+
+    return count;
+}
+
+// Merges the dirty tiles into session->rects. Returns the number of rects.
+static int merge_dirty_tiles(XwinRectSession *session)
+{
+    const unsigned char *dirty = session->dirty;
+    XwinRect *rects = session->rects;
+    XwinRect *rect;
+    int above[XWIN_TILES_X]; // rect ending in the row above, by its x
+    int count = 0;
+    int tx, ty, x;
+
+    for (tx = 0; tx < XWIN_TILES_X; tx++) {
+        above[tx] = -1;
+    }
+
+    for (ty = 0; ty < XWIN_TILES_Y; ty++) {
+        for (tx = 0; tx < XWIN_TILES_X; tx++) {
+            if (!dirty[ty * XWIN_TILES_X + tx]) {
+                above[tx] = -1;
+                continue;
+            }
+            for (x = tx; x < XWIN_TILES_X && dirty[ty * XWIN_TILES_X + x];
+                 x++) {
+            }
+
+            rect = above[tx] != -1 ? &rects[above[tx]] : NULL;
+            if (rect != NULL && rect->width == x - tx &&
+                rect->y + rect->height == ty) {
+                rect->height++;
+            } else {
+                rect = &rects[count];
+                rect->x = tx;
+                rect->y = ty;
+                rect->width = x - tx;
+                rect->height = 1;
+                above[tx] = count++;
+            }
+            for (tx++; tx < x; tx++) {
+                above[tx] = -1;
+            }
+            tx--;
+        }
+    }
+
+    return count;
+}
+
+// Sends the changed rectangles of frame as one VIDEO_MSG_RECTS message,
+// nothing if there are none. Returns false if the client is gone.
+static bool send_xwin_rects(int client_fd, XwinRectSession *session,
+                            const VideoFrame *frame, bool first,
+                            const volatile unsigned int *segment_seqs,
+                            unsigned int last_seq)
+{
+    const XwinRect *rect;
+    unsigned char *p;
+    const unsigned char *src;
+    int num_rects, i, y;
+    size_t row_size;
+
+    mark_xwin_tiles(session->dirty, segment_seqs, first ? 0 : last_seq);
+    if (find_dirty_tiles(session, frame->data, first) == 0) {
+        return true;
+    }
+    num_rects = merge_dirty_tiles(session);
+
+    p = session->buf + VIDEO_MSG_HEADER_SIZE;
+    for (i = 0; i < num_rects; i++) {
+        rect = &session->rects[i];
+        p = put_u16(p, rect->x * XWIN_TILE_SIZE);
+        p = put_u16(p, rect->y * XWIN_TILE_SIZE);
+        p = put_u16(p, rect->width * XWIN_TILE_SIZE);
+        p = put_u16(p, rect->height * XWIN_TILE_SIZE);
+        row_size = rect->width * XWIN_TILE_SIZE * 4;
+        src = frame->data + (rect->y * XWIN_TILE_SIZE * FRAME_WIDTH +
+                             rect->x * XWIN_TILE_SIZE) * 4;
+        for (y = 0; y < rect->height * XWIN_TILE_SIZE; y++) {
+            memcpy(p, src, row_size);
+            p += row_size;
+            src += FRAME_WIDTH * 4;
+        }
+    }
+    put_video_msg_header(session->buf, VIDEO_MSG_RECTS, frame, FRAME_WIDTH,
+                         FRAME_HEIGHT, num_rects,
+                         p - session->buf - VIDEO_MSG_HEADER_SIZE);
+
+    if (write_all(client_fd, session->buf, p - session->buf) == -1) {
+        log("write() failed");
+        return false;
+    }
+
+    __sync_fetch_and_add(&s_xwin_capture.rect_frames, 1);
+    __sync_fetch_and_add(&s_xwin_capture.rects, num_rects);
+    __sync_fetch_and_add(&s_xwin_capture.rect_bytes, p - session->buf);
+    return true;
+}
+
+static void *start_xwin_capture(StreamerData *data)
+{
+    int client_fd = data->client_fd;
+    int fps = data->fps;
+    FrameHub *hub = &s_xwin_capture.hub;
+    unsigned int hashs[XWIN_NUM_SEGMENTS] = {0,};
+    struct pollfd pfds[2];
+    unsigned long long events;
+    const VideoFrame *frame;
+    int index;
+    int count = 0;
+    unsigned int last_seq = 0;
+    bool err = false;
+    AdaptiveRate rate;
+    long long send_time;
+    XwinOptions options = { XWIN_MODE_SEGMENT, false, XWIN_ENCODING_RAW };
+    OptionReader option_reader = { {0,}, 0 };
+    XwinRectSession *rect_session = NULL;
+#ifdef DEBUG
+    long long capture_start_time, capture_end_time;
+#endif
+
+    free(data);
+
+    // give new clients a chance to select the mode before the first frame
+    if (!read_option_lines(client_fd, &option_reader,
+                           VIDEO_OPTIONS_TIMEOUT_MS, parse_xwin_option,
+                           &options)) {
+        return NULL;
+    }
+
+    frame_hub_set_start_fps(hub, &s_xwin_fps, fps);
+    adaptive_rate_init(&rate, s_xwin_fps_min, s_xwin_fps_max, s_xwin_fps);
+    index = frame_hub_subscribe(hub, get_peer_addr(client_fd),
+                                s_xwin_fps_max != 0 ? rate.fps : 0, false);
+    if (index == -1) {
+        return NULL;
+    }
+
+#ifdef DEBUG
+    capture_start_time = get_current_time();
+#endif
+    pfds[0].fd = client_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = hub->queues[index].event_fd;
+    pfds[1].events = POLLIN;
+    while (!err) {
+        pfds[0].revents = 0;
+        pfds[1].revents = 0;
+        if (poll(pfds, 2, 100) == -1 && errno != EINTR) {
+            print_error("poll() failed");
+            break;
+        }
+
+        if (pfds[0].revents &&
+            !read_option_lines(client_fd, &option_reader, 0,
+                               parse_xwin_option, &options)) {
+            log("xwin client closed.");
+            break;
+        }
+
+        if (!pfds[1].revents) {
+            continue;
+        }
+        if (read(pfds[1].fd, &events, sizeof(events)) == -1) {
+            print_error("read() failed");
+        }
+
+        if (s_xwin_fps_max != 0 &&
+            (s_xwin_fps_min != rate.min_fps ||
+             s_xwin_fps_max != rate.max_fps)) {
+            adaptive_rate_init(&rate, s_xwin_fps_min, s_xwin_fps_max,
+                               rate.fps);
+        }
+
+        while (!err && (frame = frame_hub_take(hub, index)) != NULL) {
+            send_time = get_monotonic_time_us();
+            if (s_xwin_fps_max != 0 &&
+                !adaptive_rate_due(&rate, client_fd, send_time)) {
+                frame_hub_release(hub, frame);
+                continue;
+            }
+
+            options.mode_locked = true;
+            if (options.mode == XWIN_MODE_RECT) {
+                if (rect_session == NULL) {
+                    rect_session = malloc(sizeof(*rect_session));
+                    if (rect_session == NULL) {
+                        print_error("malloc() failed");
+                        frame_hub_release(hub, frame);
+                        err = true;
+                        break;
+                    }
+                }
+                err = !send_xwin_rects(client_fd, rect_session, frame,
+                                       count++ == 0,
+                                       s_xwin_capture.segment_seqs, last_seq);
+            } else {
+                err = !send_xwin_frame(client_fd, frame->data, hashs, count++,
+                                       s_xwin_capture.segment_seqs, last_seq,
+                                       options.encoding);
+            }
+            last_seq = frame->seq;
+            frame_hub_release(hub, frame);
+
+            if (s_xwin_fps_max != 0) {
+                adaptive_rate_sent(&rate, client_fd,
+                                   get_monotonic_time_us() - send_time,
+                                   false);
+            }
+            frame_hub_set_fps(hub, index, s_xwin_fps_max != 0 ? rate.fps : 0);
+        }
+    }
+#ifdef DEBUG
+    capture_end_time = get_current_time();
+    log("time = %f", (capture_end_time - capture_start_time) / 1000.0);
+#endif
+
+    frame_hub_unsubscribe(hub, index);
+    free(rect_session);
+
+    return NULL;
+}
+
+static int get_adaptive_fps(int port, in_addr_t peer_addr)
+{
+    if (port == PORT_VIDEO) {
+        return frame_hub_peer_fps(&s_video_capture.hub, peer_addr);
+    } else if (port == PORT_XWIN) {
+        return frame_hub_peer_fps(&s_xwin_capture.hub, peer_addr);
+    }
+    return 0;
+}
+
+static void run_command(char *command_line)
+{
+    pid_t pid = fork();
+    if (pid == 0) { // child
+        log("execvp(), %s", command_line);
+#define MAX_ARGS 63
+        int argc = 0;
+        char *argv[MAX_ARGS + 1];
+        char *p = strtok(command_line, " ");
+        while (p && argc < MAX_ARGS) {
+            argv[argc++] = p;
+            p = strtok(NULL, " ");
+        }
+        argv[argc] = NULL;
+        execvp(argv[0], argv);
+    } else if (pid > 0) {
+        // parent. do nothing
+    } else {
+        print_error("fork() failed!");
+    }
+}
+
+#define EXECUTOR_CHUNK_SIZE 1024 // clients reject bigger chunks
+#define EXECUTOR_ERROR_LINE_MAX 320 // fits any command line
+#define STATS_BUF_SIZE 4096
+
+// "snapshot[=jpeg|nv12]" executor command. The newest LCD buffer is copied,
+// fingerprinted before and after the copy and copied again if the two
+// differ (torn by the LCD writer). The output is a framed video message
+// header (VIDEO_MSG_JPEG or VIDEO_MSG_FRAME, PAYLOAD_SIZE is the image size)
+// followed by the image, in the usual executor chunks, or nothing if no
+// consistent copy was made. The last image is cached with the fingerprint
+// of its buffer, so asking again before the LCD changes doesn't encode it
+// again. JPEG needs USE_LIBJPEG, the default is JPEG if available.
+#define SNAPSHOT_MAX_TRIES 4
+#define SNAPSHOT_SAMPLE_MS 40 // to find the newest buffer without a capture
+#define SNAPSHOT_SAMPLE_STRIDE 4096
+#define SNAPSHOT_JPEG_QUALITY 95
+
+// Writes size bytes as executor output chunks: SIZE(4, big endian) + DATA.
+// The terminating zero size is written by the command loop.
+static int write_command_output(int client_fd, const void *buf, size_t size)
+{
+    const unsigned char *p = buf;
+    unsigned char header[4];
+    size_t chunk_size;
+
+    while (size > 0) {
+        chunk_size = size < EXECUTOR_CHUNK_SIZE ? size : EXECUTOR_CHUNK_SIZE;
+        put_u32(header, chunk_size);
+        if (write_all(client_fd, header, sizeof(header)) == -1 ||
+            write_all(client_fd, p, chunk_size) == -1) {
+            return -1;
+        }
+        p += chunk_size;
+        size -= chunk_size;
+    }
+
+    return 0;
+}
+
+// Parses arg, the value of an executor command, as a decimal in [min, max].
+// Otherwise an "error:" line is written as the command output and false is
+// returned.
+static bool parse_command_int(int client_fd, const char *command,
+                              const char *arg, int min, int max, int *value)
+{
+    char line[EXECUTOR_ERROR_LINE_MAX];
+    char *end;
+    long n;
+    int size;
+
+    errno = 0;
+    n = strtol(arg, &end, 10);
+    if (errno == 0 && end != arg && *end == '\0' && n >= min && n <= max) {
+        *value = n;
+        return true;
+    }
+
+    log("invalid %s", command);
+    size = snprintf(line, sizeof(line), "error: invalid %s, %d..%d\n",
+                    command, min, max);
+    write_command_output(client_fd, line, size);
+    return false;
+}
+
+typedef struct {
+    int mem_fd;
+    void *addrs[S_ADDRS_SIZE];
+    int newest; // last known newest buffer, -1 if unknown
+    unsigned char *staging;
+    VideoSession session; // JPEG encoder
+    int type;             // of the cached image, 0 if none
+    unsigned int hash;    // of the cached buffer
+    int width;
+    int height;
+    const unsigned char *data;
+    size_t size;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long torn;
+} Snapshot;
+
+static Snapshot s_snapshot = { -1, {NULL,}, -1, };
+
+// Returns the index of the LCD buffer written last. Without a running
+// capture, the buffers that change within a frame interval tell.
+static int find_newest_buffer(Snapshot *snapshot)
+{
+    unsigned int hashs[S_ADDRS_SIZE];
+    int next[S_ADDRS_SIZE];
+    unsigned int changed = 0;
+    int i;
+
+    if (s_video_capture.newest != -1) {
+        return s_video_capture.newest;
+    }
+
+    for (i = 0; i < S_ADDRS_SIZE; i++) {
+        hashs[i] = fingerprint(snapshot->addrs[i], VIDEO_FRAME_SIZE,
+                               SNAPSHOT_SAMPLE_STRIDE);
+        next[i] = -1;
+    }
+    usleep(SNAPSHOT_SAMPLE_MS * 1000);
+    for (i = 0; i < S_ADDRS_SIZE; i++) {
+        if (fingerprint(snapshot->addrs[i], VIDEO_FRAME_SIZE,
+                        SNAPSHOT_SAMPLE_STRIDE) != hashs[i]) {
+            changed |= 1u << i;
+        }
+    }
+
+    i = select_newest_buffer(next, snapshot->newest, changed);
+    if (i != -1) {
+        snapshot->newest = i;
+    }
+    // a still scene is the same in every buffer
+    return snapshot->newest != -1 ? snapshot->newest : 0;
+}
+
+// Copies LCD buffer index, whose fingerprint is *hash, into
+// snapshot->staging. Returns false if every try was torn, otherwise *hash
+// is the fingerprint of the copy.
+static bool copy_snapshot(Snapshot *snapshot, int index, unsigned int *hash)
+{
+    unsigned int copy_hash;
+    int i;
+
+    for (i = 0; i < SNAPSHOT_MAX_TRIES; i++) {
+        s_staging_copier->copy(snapshot->staging, snapshot->addrs[index],
+                               VIDEO_FRAME_SIZE);
+        copy_hash = fingerprint(snapshot->staging, VIDEO_FRAME_SIZE,
+                                FINGERPRINT_BLOCK_SIZE);
+        if (copy_hash == *hash) {
+            return true;
+        }
+        snapshot->torn++;
+        *hash = fingerprint(snapshot->addrs[index], VIDEO_FRAME_SIZE,
+                            FINGERPRINT_BLOCK_SIZE);
+    }
+
+    return false;
+}
+
+// Takes the snapshot, or finds it in the cache. Returns false on failure.
+static bool take_snapshot(Snapshot *snapshot, int type)
+{
+    VideoFrame frame;
+    Nv12Image image;
+    unsigned int hash;
+    int index, i;
+    int width, height;
+#ifdef USE_LIBJPEG
+    VideoOptions options;
+    unsigned long jpeg_size;
+#endif
+
+    // mem_fd != -1 means everything below is set up
+    if (snapshot->mem_fd == -1) {
+        if (snapshot->staging == NULL) {
+            snapshot->staging = alloc_frame_buffer(VIDEO_FRAME_SIZE);
+            if (snapshot->staging == NULL) {
+                print_error("malloc() failed");
+                return false;
+            }
+        }
+        snapshot->mem_fd = open("/dev/mem", O_RDWR);
+        if (snapshot->mem_fd == -1) {
+            print_error("open() failed");
+            return false;
+        }
+        for (i = 0; i < S_ADDRS_SIZE; i++) {
+            snapshot->addrs[i] = mmap_lcd(snapshot->mem_fd, s_addrs[i]);
+        }
+        video_session_init(&snapshot->session, -1);
+    }
+
+    // the same buffer is another image when the recording started
+    read_active_area(&width, &height);
+    index = find_newest_buffer(snapshot);
+    hash = fingerprint(snapshot->addrs[index], VIDEO_FRAME_SIZE,
+                       FINGERPRINT_BLOCK_SIZE);
+    if (hash == snapshot->hash && type == snapshot->type &&
+        width == snapshot->width && height == snapshot->height) {
+        snapshot->hits++;
+        return true;
+    }
+    snapshot->misses++;
+    snapshot->type = 0;
+
+    if (!copy_snapshot(snapshot, index, &hash)) {
+        log("snapshot is torn.");
+        return false;
+    }
+
+    frame.data = snapshot->staging;
+    frame.width = width;
+    frame.height = height;
+    nv12_image_init(&image, frame.data, frame.width, frame.height);
+
+    if (type == VIDEO_MSG_FRAME) {
+        snapshot->data = image.y;
+        snapshot->size = nv12_image_size(&image);
+#ifdef USE_LIBJPEG
+    } else {
+        video_options_init(&options);
+        options.jpeg_quality = SNAPSHOT_JPEG_QUALITY;
+        jpeg_size = encode_video_jpeg(&snapshot->session, &options, &image);
+        if (jpeg_size == 0) {
+            return false;
+        }
+        snapshot->data = snapshot->session.jpeg_buf;
+        snapshot->size = jpeg_size;
+#endif
+    }
+    snapshot->type = type;
+    snapshot->hash = hash;
+    snapshot->width = frame.width;
+    snapshot->height = frame.height;
+
+    return true;
+}
+
+// Writes the snapshot for "snapshot[=jpeg|nv12]" as executor output.
+static int write_snapshot(int client_fd, const char *format)
+{
+    unsigned char header[VIDEO_MSG_HEADER_SIZE];
+    VideoFrame frame;
+#ifdef USE_LIBJPEG
+    int type = VIDEO_MSG_JPEG;
+#else
+    int type = VIDEO_MSG_FRAME;
+#endif
+
+    if (strcmp(format, "nv12") == 0) {
+        type = VIDEO_MSG_FRAME;
+    } else if (strcmp(format, "jpeg") == 0) {
+#ifndef USE_LIBJPEG
+        log("snapshot=jpeg needs USE_LIBJPEG.");
+        return 0;
+#endif
+    }
+
+    if (!take_snapshot(&s_snapshot, type)) {
+        return 0;
+    }
+
+    memset(&frame, 0, sizeof(frame));
+    frame.timestamp = get_monotonic_time_us();
+    put_video_msg_header(header, s_snapshot.type, &frame, s_snapshot.width,
+                         s_snapshot.height, 1, s_snapshot.size);
+    if (write_command_output(client_fd, header, sizeof(header)) == -1) {
+        return -1;
+    }
+    return write_command_output(client_fd, s_snapshot.data, s_snapshot.size);
+}
+
+// <name>_jitter_us is "bound:count,..." with the upper bound of each
+// histogram bin, the last bin has no bound
+static size_t format_pacer_stats(char *buf, size_t size, const char *name,
+                                 const Pacer *pacer)
+{
+    size_t len;
+    int i;
+
+    len = snprintf(buf, size, "%s_ticks=%lu\n%s_skipped=%lu\n%s_jitter_us=",
+                   name, pacer->ticks, name, pacer->skipped, name);
+    for (i = 0; i < PACER_JITTER_BINS && len < size; i++) {
+        if (i < PACER_JITTER_BINS - 1) {
+            len += snprintf(buf + len, size - len, "%ld:%lu,",
+                            PACER_JITTER_BINS_US[i], pacer->jitter[i]);
+        } else {
+            len += snprintf(buf + len, size - len, "inf:%lu\n",
+                            pacer->jitter[i]);
+        }
+    }
+
+    return len < size ? len : size - 1;
+}
+
+// "key=value" lines returned by the "stats" command
+static size_t format_stats(char *buf, size_t size)
+{
+    int len;
+
+    const VideoStats *video = &s_video_stats;
+
+    len = snprintf(buf, size,
+                   "video_captured=%lu\n"
+                   "video_sent=%lu\n"
+                   "video_dropped=%lu\n"
+                   "video_write_bytes=%llu\n"
+                   "video_write_cpu_us=%llu\n"
+                   "video_write_bytes_per_cpu_sec=%llu\n"
+                   "video_splice_bytes=%llu\n"
+                   "video_splice_cpu_us=%llu\n"
+                   "video_splice_bytes_per_cpu_sec=%llu\n"
+                   "video_staging_copy=%s\n"
+                   "video_staging_bytes=%llu\n"
+                   "video_staging_us=%llu\n"
+                   "video_jpeg_frames=%lu\n"
+                   "video_jpeg_bytes=%llu\n"
+                   "video_jpeg_encode_us=%llu\n"
+                   "video_jpeg_encode_us_per_frame=%llu\n"
+                   "video_static_skipped=%lu\n"
+                   "video_static_skip_percent=%lu\n"
+                   "video_change_detect_us=%llu\n"
+                   "video_layers=%lu\n"
+                   "video_preempted=%lu\n"
+                   "video_udp_datagrams=%lu\n"
+                   "video_udp_bytes=%llu\n"
+                   "video_udp_cut=%lu\n"
+                   "video_peaking_masks=%lu\n"
+                   "video_peaking_bytes=%llu\n"
+                   "video_peaking_us=%llu\n"
+                   "video_torn=%lu\n"
+                   "video_torn_skipped=%lu\n"
+                   "video_tear_check_us=%llu\n",
+                   video->captured,
+                   video->sent,
+                   video->dropped,
+                   video->write_bytes,
+                   video->write_cpu_us,
+                   video->write_bytes * 1000000 / (video->write_cpu_us + 1),
+                   video->splice_bytes,
+                   video->splice_cpu_us,
+                   video->splice_bytes * 1000000 / (video->splice_cpu_us + 1),
+                   s_staging_copier->name,
+                   video->staging_bytes,
+                   video->staging_us,
+                   video->jpeg_frames,
+                   video->jpeg_bytes,
+                   video->jpeg_encode_us,
+                   video->jpeg_encode_us / (video->jpeg_frames + 1),
+                   video->static_skipped,
+                   video->static_skipped * 100
+                   / (video->static_skipped + video->captured + 1),
+                   video->change_detect_us,
+                   video->layers,
+                   video->preempted,
+                   video->udp_datagrams,
+                   video->udp_bytes,
+                   video->udp_cut,
+                   video->peaking_masks,
+                   video->peaking_bytes,
+                   video->peaking_us,
+                   video->torn,
+                   video->torn_skipped,
+                   video->tear_check_us);
+    if (len < 0) {
+        return 0;
+    } else if ((size_t)len >= size) {
+        return size - 1;
+    }
+
+    len += snprintf(buf + len, size - len,
+                    "motion_frames=%lu\n"
+                    "motion_events=%lu\n"
+                    "motion_detect_us=%llu\n"
+                    "snapshot_hits=%lu\n"
+                    "snapshot_misses=%lu\n"
+                    "snapshot_torn=%lu\n"
+                    "xwin_grabber=%s\n"
+                    "xwin_grabs=%lu\n"
+                    "xwin_grab_us_per_frame=%llu\n"
+                    "xwin_damage_rects=%lu\n"
+                    "xwin_damage_pixels=%llu\n"
+                    "xwin_idle_ticks=%lu\n"
+                    "xwin_rect_frames=%lu\n"
+                    "xwin_rects=%lu\n"
+                    "xwin_rect_bytes=%llu\n"
+                    "xwin_segments=%lu\n"
+                    "xwin_rle_segments=%lu\n"
+                    "xwin_segment_bytes=%llu\n"
+                    "xwin_segment_raw_bytes=%llu\n"
+                    "xwin_compression_percent=%llu\n"
+                    "xwin_rle_us=%llu\n",
+                    s_motion.frames, s_motion.events, s_motion.detect_us,
+                    s_snapshot.hits, s_snapshot.misses, s_snapshot.torn,
+                    s_xwin_capture.grabber, s_xwin_capture.grabs,
+                    s_xwin_capture.grab_us / (s_xwin_capture.grabs + 1),
+                    s_xwin_capture.damage_rects, s_xwin_capture.damage_pixels,
+                    s_xwin_capture.idle_ticks, s_xwin_capture.rect_frames,
+                    s_xwin_capture.rects, s_xwin_capture.rect_bytes,
+                    s_xwin_capture.segments, s_xwin_capture.rle_segments,
+                    s_xwin_capture.segment_bytes,
+                    s_xwin_capture.segment_raw_bytes,
+                    s_xwin_capture.segment_bytes * 100
+                    / (s_xwin_capture.segment_raw_bytes + 1),
+                    s_xwin_capture.rle_us);
+    if ((size_t)len >= size) {
+        return size - 1;
+    }
+
+    len += format_pacer_stats(buf + len, size - len, "video_pacing",
+                              &s_video_pacer);
+    len += format_pacer_stats(buf + len, size - len, "xwin_pacing",
+                              &s_xwin_pacer);
+
+    return len;
+}
+
+static void *start_executor(StreamerData *data)
 {
     FILE *client_sock;
     int client_fd = data->client_fd;;
@@ -583,6 +5535,7 @@ static void *start_executor(StreamerData *data)
     FILE *inject_input_pipe = NULL;
     long long last_ping_time;
     int flags;
+    int value;
 
     client_sock = fdopen(data->client_fd, "r");
     if (client_sock == NULL) {
@@ -669,6 +5622,29 @@ static void *start_executor(StreamerData *data)
         } else if (strncmp("xfps=", command_line, 5) == 0) {
             s_xwin_fps = atoi(command_line+5);
             fprintf(stderr, "xwin fps = %d\n", s_xwin_fps);
+        } else if (strncmp("motion", command_line, 6) == 0) {
+            set_motion_option(&s_motion, command_line);
+        } else if (strncmp("vthreshold=", command_line, 11) == 0) {
+            if (parse_command_int(client_fd, command_line, command_line + 11,
+                                  0, VIDEO_CHANGE_THRESHOLD_MAX, &value)) {
+                s_video_change_threshold = value;
+            }
+        } else if (strncmp("vrefresh=", command_line, 9) == 0) {
+            if (parse_command_int(client_fd, command_line, command_line + 9,
+                                  0, VIDEO_CHANGE_REFRESH_MAX_MS, &value)) {
+                s_video_refresh_ms = value;
+            }
+        } else if (strncmp("xfps_min=", command_line, 9) == 0) {
+            s_xwin_fps_min = atoi(command_line + 9);
+        } else if (strncmp("xfps_max=", command_line, 9) == 0) {
+            s_xwin_fps_max = atoi(command_line + 9);
+        } else if (strcmp("xgrab=xshm", command_line) == 0) {
+#ifndef USE_XSHM
+            log("xgrab=xshm needs USE_XSHM.");
+#endif
+            s_xwin_xshm = true;
+        } else if (strcmp("xgrab=xwd", command_line) == 0) {
+            s_xwin_xshm = false;
         } else if (strncmp("lcd=on", command_line, 6) == 0) {
             system(LCD_CONTROL_SH_COMMAND " on");
         } else if (strncmp("lcd=off", command_line, 7) == 0) {
@@ -679,6 +5655,21 @@ static void *start_executor(StreamerData *data)
             system(LCD_CONTROL_SH_COMMAND " osd");
         } else if (strncmp("ping", command_line, 4) == 0) {
             last_ping_time = get_current_time();
+        } else if (strcmp("snapshot", command_line) == 0 ||
+                   strncmp("snapshot=", command_line, 9) == 0) {
+            if (write_snapshot(client_fd, command_line[8] == '=' ?
+                               command_line + 9 : "") == -1) {
+                print_error("write() failed!");
+                goto error;
+            }
+        } else if (strcmp("stats", command_line) == 0) {
+            char stats[STATS_BUF_SIZE];
+            size_t stats_size = format_stats(stats, sizeof(stats));
+
+            if (write_command_output(client_fd, stats, stats_size) == -1) {
+                print_error("write() failed!");
+                goto error;
+            }
         }
 
         // EOF
@@ -716,12 +5707,45 @@ error:
     return NULL;
 }
 
+// Runs on_connect for one client and cleans up after it.
+static void *connection_thread(void *thread_data)
+{
+    ConnectionData *connection = (ConnectionData *)thread_data;
+    int port = connection->port;
+    int client_fd = connection->data->client_fd;
+    int *socket_connect_count = connection->socket_connect_count;
+    in_addr_t peer_addr = get_peer_addr(client_fd);
+
+    connection->on_connect(connection->data);
+    free(connection);
+
+    __sync_fetch_and_sub(socket_connect_count, 1);
+
+    close(client_fd);
+
+    log("client closed. port = %d (%s)", port, get_port_name(port));
+    log("connected socket count = %d", *socket_connect_count);
+    if (port == PORT_VIDEO) {
+        s_video_socket_closed_notify = true;
+    } else if (port == PORT_XWIN) {
+        s_xwin_socket_closed_notify = true;
+    } else if (port == PORT_EXECUTOR) {
+        s_executor_socket_closed_notify = true;
+    } else if (port == PORT_NOTIFY) {
+        // only the video of that phone, other viewers go on
+        frame_hub_close_peer(&s_video_capture.hub, peer_addr);
+    }
+
+    return NULL;
+}
+
 static void *listen_socket_func(void *thread_data)
 {
     ListenSocketData *listen_socket_data = (ListenSocketData *)thread_data;
     int port = listen_socket_data->port;
     OnConnect on_connect = listen_socket_data->on_connect;
     int *socket_connect_count = listen_socket_data->socket_connect_count;
+    bool multi_client = listen_socket_data->multi_client;
     struct sockaddr_in server_addr, client_addr;
     int server_fd, client_fd;
     socklen_t len;
@@ -752,12 +5776,13 @@ static void *listen_socket_func(void *thread_data)
         die("listen() failed");
     }
 
-    len = sizeof(client_addr);
-
     while (true) {
         StreamerData *data = (StreamerData *)malloc(sizeof(StreamerData));
+        ConnectionData *connection
+            = (ConnectionData *)malloc(sizeof(ConnectionData));
 
         log("waiting client... port = %d (%s)", port, get_port_name(port));
+        len = sizeof(client_addr);
         client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &len);
         if (client_fd == -1) {
             die("accept() failed");
@@ -769,33 +5794,23 @@ static void *listen_socket_func(void *thread_data)
         data->client_fd = client_fd;
         data->fps = 5;
 
-        (*socket_connect_count)++;
-        if (pthread_create(&thread, NULL,
-                           (void *(*)(void *))on_connect, data)) {
+        connection->port = port;
+        connection->on_connect = on_connect;
+        connection->socket_connect_count = socket_connect_count;
+        connection->data = data;
+
+        __sync_fetch_and_add(socket_connect_count, 1);
+        if (pthread_create(&thread, NULL, connection_thread, connection)) {
             die("ptherad_create() failed");
         }
 
-        if (pthread_join(thread, NULL)) {
+        if (multi_client) {
+            if (pthread_detach(thread)) {
+                die("pthread_detach() failed");
+            }
+        } else if (pthread_join(thread, NULL)) {
             die("pthread_join() failed");
         }
-
-        if (*socket_connect_count > 0) {
-            (*socket_connect_count)--;
-        }
-
-        close(client_fd);
-
-        log("client closed. port = %d (%s)", port, get_port_name(port));
-        log("connected socket count = %d", *socket_connect_count);
-        if (port == PORT_VIDEO) {
-            s_video_socket_closed_notify = true;
-        } else if (port == PORT_XWIN) {
-            s_xwin_socket_closed_notify = true;
-        } else if (port == PORT_EXECUTOR) {
-            s_executor_socket_closed_notify = true;
-        } else if (port == PORT_NOTIFY) {
-            s_video_socket_close_request = true;
-        }
     }
 
     close(server_fd);
@@ -803,7 +5818,8 @@ static void *listen_socket_func(void *thread_data)
     return NULL;
 }
 
-static void listen_socket(const int port, const OnConnect on_connect, int *socket_connect_count)
+static void listen_socket(const int port, const OnConnect on_connect,
+                          int *socket_connect_count, bool multi_client)
 {
     pthread_t thread;
     ListenSocketData *thread_data
@@ -811,6 +5827,7 @@ static void listen_socket(const int port, const OnConnect on_connect, int *socke
     thread_data->port = port;
     thread_data->on_connect = on_connect;
     thread_data->socket_connect_count = socket_connect_count;
+    thread_data->multi_client = multi_client;
 
     if (pthread_create(&thread, NULL, listen_socket_func, thread_data)) {
         die("pthread_create() failed!");
@@ -884,10 +5901,25 @@ int main(int argc, char **argv)
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCHLD, SIG_IGN);
 
-    listen_socket(PORT_NOTIFY, start_notify, &socket_connect_count);
-    listen_socket(PORT_VIDEO, start_video_capture, &socket_connect_count);
-    listen_socket(PORT_XWIN, start_xwin_capture, &socket_connect_count);
-    listen_socket(PORT_EXECUTOR, start_executor, &socket_connect_count);
+    pin_off_capture_cpu();
+
+    s_video_capture.newest = -1;
+    frame_hub_init(&s_video_capture.hub, VIDEO_FRAME_SIZE,
+                   video_capture_start, video_capture_stop, &s_video_capture,
+                   &s_video_stats.dropped);
+    frame_hub_init(&s_xwin_capture.hub, XWIN_FRAME_SIZE,
+                   xwin_capture_start, xwin_capture_stop, &s_xwin_capture,
+                   NULL);
+
+    // video, xwin and analytics streams can have several viewers
+    listen_socket(PORT_NOTIFY, start_notify, &socket_connect_count, false);
+    listen_socket(PORT_VIDEO, start_video_capture, &socket_connect_count,
+                  true);
+    listen_socket(PORT_XWIN, start_xwin_capture, &socket_connect_count, true);
+    listen_socket(PORT_EXECUTOR, start_executor, &socket_connect_count,
+                  false);
+    listen_socket(PORT_ANALYTICS, start_analytics, &socket_connect_count,
+                  true);
 
     broadcast_discovery_packet(PORT_UDP_BROADCAST, &socket_connect_count);
 
@@ -0,0 +1,28 @@
+// Shared by the host tests (test_*.c, ./build.sh test). The tests include
+// the daemon source to reach its static functions.
+
+#define main daemon_main
+#include "nx-remote-controller-daemon.c"
+#undef main
+
+static int s_failures;
+
+#define check(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        s_failures++; \
+    } \
+} while (0)
+
+// Returns the exit status of the test program.
+static int test_result(const char *name)
+{
+    if (s_failures != 0) {
+        fprintf(stderr, "%s: %d failures\n", name, s_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
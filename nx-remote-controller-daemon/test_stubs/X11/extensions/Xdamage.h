@@ -0,0 +1,26 @@
+// The declarations of libXdamage that the daemon uses, for test_xdamage.c
+// on hosts without the libXdamage headers. The test defines the functions.
+
+#ifndef _XDAMAGE_H_
+#define _XDAMAGE_H_
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xfixes.h>
+
+typedef XID Damage;
+
+#define XDamageNotify 0
+
+#define XDamageReportRawRectangles 0
+#define XDamageReportDeltaRectangles 1
+#define XDamageReportBoundingBox 2
+#define XDamageReportNonEmpty 3
+
+Bool XDamageQueryExtension(Display *dpy, int *event_base_return,
+                           int *error_base_return);
+Damage XDamageCreate(Display *dpy, Drawable drawable, int level);
+void XDamageDestroy(Display *dpy, Damage damage);
+void XDamageSubtract(Display *dpy, Damage damage, XserverRegion repair,
+                     XserverRegion parts);
+
+#endif
@@ -0,0 +1,359 @@
+// Host test of the UDP video transport over loopback: the client reassembles
+// NXVU fragments with simulated loss and drops incomplete messages, and the
+// stream falls back to TCP when the client port is closed. The adaptive
+// rate follows the UDP socket.
+// Built and run by ./build.sh test.
+
+#include "test.h"
+
+#define TEST_FRAMES 200
+#define TEST_LOSS_PERCENT 2
+#define TEST_SCALE 4
+#define TEST_MSG_SIZE (VIDEO_MSG_HEADER_SIZE + \
+        FRAME_WIDTH / TEST_SCALE * FRAME_HEIGHT / TEST_SCALE * 3 / 2)
+
+typedef struct {
+    int server_fd; // video socket of the daemon
+    int client_fd;
+    VideoSession session;
+    VideoOptions options;
+    VideoFrame frame;
+} TestStream;
+
+typedef struct {
+    unsigned char buf[TEST_MSG_SIZE];
+    unsigned int id;
+    int count;   // fragments of the message
+    int received;
+    bool started;
+    int complete;
+    int incomplete;
+    int corrupt;
+    int lost;    // datagrams dropped on purpose
+} Reassembler;
+
+static unsigned int get_u32(const unsigned char *p)
+{
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Connects a TCP pair over loopback, so that the daemon side has an IPv4
+// peer to send datagrams to, and selects the options.
+static void test_stream_open(TestStream *stream, const char *option_lines)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    OptionReader reader = { {0,}, 0 };
+    int listen_fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 1) == -1 ||
+        getsockname(listen_fd, (struct sockaddr *)&addr, &len) == -1) {
+        die("listen failed");
+    }
+    stream->client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (stream->client_fd == -1 ||
+        connect(stream->client_fd, (struct sockaddr *)&addr,
+                sizeof(addr)) == -1) {
+        die("connect() failed");
+    }
+    stream->server_fd = accept(listen_fd, NULL, NULL);
+    if (stream->server_fd == -1) {
+        die("accept() failed");
+    }
+    close(listen_fd);
+
+    if (write_all(stream->client_fd, option_lines,
+                  strlen(option_lines)) == -1) {
+        die("write() failed");
+    }
+    video_options_init(&stream->options);
+    if (!read_video_options(stream->server_fd, &reader, &stream->options,
+                            100, false)) {
+        die("read_video_options() failed");
+    }
+
+    video_session_init(&stream->session, stream->server_fd);
+    memset(&stream->frame, 0, sizeof(stream->frame));
+    stream->frame.data = malloc(VIDEO_FRAME_SIZE);
+    if (stream->frame.data == NULL) {
+        die("malloc() failed");
+    }
+    stream->frame.width = FRAME_WIDTH;
+    stream->frame.height = FRAME_HEIGHT;
+}
+
+static void test_stream_close(TestStream *stream)
+{
+    video_session_destroy(&stream->session);
+    close(stream->server_fd);
+    close(stream->client_fd);
+    free(stream->frame.data);
+}
+
+// Sends a frame whose every byte is the low byte of seq.
+static int test_stream_send(TestStream *stream, unsigned int seq)
+{
+    memset(stream->frame.data, seq & 0xff, VIDEO_FRAME_SIZE);
+    stream->frame.seq = seq;
+    return send_video_frame(&stream->session, &stream->options,
+                            &stream->frame);
+}
+
+// Reads one framed message from the TCP socket into buf.
+static bool read_tcp_msg(int fd, unsigned char *buf, size_t size)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    size_t len = 0, msg_size = VIDEO_MSG_HEADER_SIZE;
+    ssize_t read_size;
+
+    while (len < msg_size) {
+        if (poll(&pfd, 1, 1000) != 1) {
+            return false;
+        }
+        read_size = read(fd, buf + len, msg_size - len);
+        if (read_size <= 0) {
+            return false;
+        }
+        len += read_size;
+        if (len == VIDEO_MSG_HEADER_SIZE) {
+            msg_size += get_u32(buf + 24);
+            if (msg_size > size) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// A message is good if it is the frame of its seq.
+static bool check_frame_msg(const unsigned char *msg, size_t size)
+{
+    size_t i;
+
+    if (size != TEST_MSG_SIZE || get_u32(msg) != VIDEO_MSG_MAGIC ||
+        msg[4] != VIDEO_MSG_FRAME ||
+        get_u32(msg + 24) != size - VIDEO_MSG_HEADER_SIZE) {
+        return false;
+    }
+    for (i = VIDEO_MSG_HEADER_SIZE; i < size; i++) {
+        if (msg[i] != (get_u32(msg + 8) & 0xff)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void reassembler_finish(Reassembler *r)
+{
+    if (!r->started) {
+        return;
+    }
+    if (r->received != r->count) {
+        r->incomplete++;
+    } else if (check_frame_msg(r->buf, TEST_MSG_SIZE)) {
+        r->complete++;
+    } else {
+        r->corrupt++;
+    }
+    r->started = false;
+}
+
+// Reads the queued datagrams, losing loss_percent of them. A message is
+// complete when all fragments arrived; it is dropped when a newer message
+// starts before that.
+static void reassembler_read(Reassembler *r, int udp_fd, int loss_percent)
+{
+    unsigned char datagram[VIDEO_UDP_HEADER_SIZE + VIDEO_UDP_DATA_SIZE];
+    ssize_t size;
+    unsigned int id;
+    int fragment, count;
+
+    while ((size = recv(udp_fd, datagram, sizeof(datagram),
+                        MSG_DONTWAIT)) > 0) {
+        if (rand() % 100 < loss_percent) {
+            r->lost++;
+            continue;
+        }
+        check(size > VIDEO_UDP_HEADER_SIZE &&
+              get_u32(datagram) == VIDEO_UDP_MAGIC, "bad datagram");
+        id = get_u32(datagram + 4);
+        fragment = datagram[8] << 8 | datagram[9];
+        count = datagram[10] << 8 | datagram[11];
+        if (!r->started || id != r->id) {
+            check(!r->started || id > r->id, "message id went back");
+            reassembler_finish(r);
+            r->started = true;
+            r->id = id;
+            r->count = count;
+            r->received = 0;
+        }
+        if (fragment >= count || count != r->count ||
+            (size_t)fragment * VIDEO_UDP_DATA_SIZE + size
+                - VIDEO_UDP_HEADER_SIZE > TEST_MSG_SIZE) {
+            r->corrupt++;
+            continue;
+        }
+        memcpy(r->buf + fragment * VIDEO_UDP_DATA_SIZE,
+               datagram + VIDEO_UDP_HEADER_SIZE, size - VIDEO_UDP_HEADER_SIZE);
+        r->received++;
+        if (r->received == r->count) {
+            reassembler_finish(r);
+        }
+    }
+}
+
+// Binds a UDP socket on loopback and returns its port in *port.
+static int open_udp(int *port)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int size = 1024 * 1024;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) == -1) {
+        die("udp socket failed");
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static void test_loss(int loss_percent)
+{
+    static Reassembler r;
+    static unsigned char msg[VIDEO_MSG_HEADER_SIZE];
+    TestStream stream;
+    char option_lines[64];
+    int udp_fd, port;
+    unsigned int seq;
+
+    memset(&r, 0, sizeof(r));
+    srand(1);
+    udp_fd = open_udp(&port);
+    snprintf(option_lines, sizeof(option_lines),
+             "mode=frame\nscale=%d\ntransport=udp:%d\n", TEST_SCALE, port);
+    test_stream_open(&stream, option_lines);
+
+    for (seq = 1; seq <= TEST_FRAMES; seq++) {
+        check(test_stream_send(&stream, seq) == 0, "send failed");
+        reassembler_read(&r, udp_fd, loss_percent);
+    }
+    reassembler_finish(&r);
+
+    // the switch to UDP is the only message on TCP
+    check(read_tcp_msg(stream.client_fd, msg, sizeof(msg)) &&
+          msg[4] == VIDEO_MSG_TRANSPORT && (msg[6] << 8 | msg[7]) == port,
+          "no transport message");
+    check(r.corrupt == 0, "loss %d%%: %d corrupt messages", loss_percent,
+          r.corrupt);
+    check(r.complete + r.incomplete == TEST_FRAMES,
+          "loss %d%%: %d complete + %d incomplete of %d", loss_percent,
+          r.complete, r.incomplete, TEST_FRAMES);
+    if (loss_percent == 0) {
+        check(r.complete == TEST_FRAMES, "%d messages lost", r.incomplete);
+    } else {
+        check(r.lost > 0 && r.incomplete > 0 && r.complete > 0,
+              "loss %d%%: lost %d, %d complete, %d incomplete", loss_percent,
+              r.lost, r.complete, r.incomplete);
+    }
+    printf("loss %d%%: %d datagrams lost, %d messages complete, "
+           "%d dropped\n", loss_percent, r.lost, r.complete, r.incomplete);
+
+    test_stream_close(&stream);
+    close(udp_fd);
+}
+
+static void test_closed_port(void)
+{
+    static unsigned char msg[TEST_MSG_SIZE];
+    TestStream stream;
+    char option_lines[64];
+    int port, frames = 0;
+    unsigned int seq;
+
+    close(open_udp(&port));
+    snprintf(option_lines, sizeof(option_lines),
+             "mode=frame\nscale=%d\ntransport=udp:%d\n", TEST_SCALE, port);
+    test_stream_open(&stream, option_lines);
+
+    for (seq = 1; seq <= 4; seq++) {
+        check(test_stream_send(&stream, seq) == 0, "send failed");
+    }
+
+    // UDP, then back to TCP once the port is found unreachable
+    check(read_tcp_msg(stream.client_fd, msg, sizeof(msg)) &&
+          msg[4] == VIDEO_MSG_TRANSPORT && (msg[6] << 8 | msg[7]) == port,
+          "no udp transport message");
+    check(read_tcp_msg(stream.client_fd, msg, sizeof(msg)) &&
+          msg[4] == VIDEO_MSG_TRANSPORT && (msg[6] << 8 | msg[7]) == 0,
+          "no tcp transport message");
+    while (read_tcp_msg(stream.client_fd, msg, sizeof(msg))) {
+        check(check_frame_msg(msg, VIDEO_MSG_HEADER_SIZE
+                                   + get_u32(msg + 24)), "bad tcp frame");
+        frames++;
+        if (get_u32(msg + 8) == 4) {
+            break;
+        }
+    }
+    check(frames >= 2, "%d frames over tcp", frames);
+    check(stream.session.sender.udp_fd == -1 &&
+          stream.session.sender.udp_unreachable_port == port,
+          "udp still open");
+
+    test_stream_close(&stream);
+}
+
+// The rate watches the UDP socket, not the idle TCP connection, and drops
+// after a cut message.
+static void test_adaptive_rate(void)
+{
+    TestStream stream;
+    AdaptiveRate rate;
+    char option_lines[64];
+    int udp_fd, port, fd;
+
+    udp_fd = open_udp(&port);
+    snprintf(option_lines, sizeof(option_lines),
+             "mode=frame\nscale=%d\ntransport=udp:%d\n", TEST_SCALE, port);
+    test_stream_open(&stream, option_lines);
+    check(test_stream_send(&stream, 1) == 0, "send failed");
+    fd = video_sender_queue_fd(&stream.session.sender);
+    check(fd == stream.session.sender.udp_fd && fd != stream.server_fd,
+          "rate watches fd %d", fd);
+
+    adaptive_rate_init(&rate, 1, 30, 30);
+    check(adaptive_rate_due(&rate, fd, 0), "first frame not due");
+    adaptive_rate_sent(&rate, fd, 0, false);
+    check(adaptive_rate_due(&rate, fd, 1000000) && rate.fps == 30,
+          "fps %d without a cut", rate.fps);
+    adaptive_rate_sent(&rate, fd, 0, true);
+    check(adaptive_rate_due(&rate, fd, 2000000) && rate.fps == 22,
+          "fps %d after a cut", rate.fps);
+
+    test_stream_close(&stream);
+    close(udp_fd);
+}
+
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    test_loss(0);
+    test_loss(TEST_LOSS_PERCENT);
+    test_closed_port();
+    test_adaptive_rate();
+
+    return test_result("test_video_udp");
+}
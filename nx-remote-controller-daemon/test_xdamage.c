@@ -0,0 +1,345 @@
+// Host test of the XDamage OSD capture with the X calls stubbed: damaged
+// rectangles are read back one by one and mark exactly the segments they
+// touch, damage larger than XWIN_DAMAGE_MAX_RECT_AREA falls back to one
+// XShmGetImage(), and the first read takes the whole image. Built and run
+// by ./build.sh test, test_stubs/ has Xdamage.h for hosts without it.
+
+#if !__has_include(<X11/extensions/XShm.h>) || \
+    !__has_include(<X11/extensions/Xfixes.h>)
+#include <stdio.h>
+
+int main(void)
+{
+    printf("test_xdamage: skipped, no Xlib, MIT-SHM or XFIXES headers\n");
+    return 0;
+}
+#else
+
+#define USE_XSHM
+#define USE_XDAMAGE
+#include "test.h"
+
+#define TEST_ROOT 1
+#define TEST_DAMAGE_EVENT 90
+#define TEST_MAX_RECTS 8
+
+// What the stubbed X server reports, and what the capture asked of it.
+typedef struct {
+    int pending;                      // XDamageNotify events
+    XRectangle rects[TEST_MAX_RECTS]; // the damage region
+    int num_rects;
+    bool fail;                        // XGetSubImage() fails
+    int subtracts;
+    int full_grabs;                   // XShmGetImage()
+    XRectangle reads[TEST_MAX_RECTS]; // XGetSubImage()
+    int num_reads;
+} FakeServer;
+
+static FakeServer s_server;
+static typeof(*(_XPrivDisplay)NULL) s_display;
+static Screen s_screen;
+static XImage s_image;
+static XwinCapture s_capture;
+
+Bool XDamageQueryExtension(Display *dpy, int *event_base_return,
+                           int *error_base_return)
+{
+    *event_base_return = TEST_DAMAGE_EVENT;
+    *error_base_return = 0;
+    return True;
+}
+
+Damage XDamageCreate(Display *dpy, Drawable drawable, int level)
+{
+    return 1;
+}
+
+void XDamageDestroy(Display *dpy, Damage damage)
+{
+}
+
+void XDamageSubtract(Display *dpy, Damage damage, XserverRegion repair,
+                     XserverRegion parts)
+{
+    s_server.subtracts++;
+}
+
+Bool XFixesQueryExtension(Display *dpy, int *event_base_return,
+                          int *error_base_return)
+{
+    *event_base_return = 0;
+    *error_base_return = 0;
+    return True;
+}
+
+XserverRegion XFixesCreateRegion(Display *dpy, XRectangle *rectangles,
+                                 int nrectangles)
+{
+    return 1;
+}
+
+void XFixesDestroyRegion(Display *dpy, XserverRegion region)
+{
+}
+
+XRectangle *XFixesFetchRegion(Display *dpy, XserverRegion region,
+                              int *nrectanglesRet)
+{
+    XRectangle *rects = malloc(sizeof(s_server.rects));
+
+    memcpy(rects, s_server.rects, sizeof(s_server.rects));
+    *nrectanglesRet = s_server.num_rects;
+    return rects;
+}
+
+int XFree(void *data)
+{
+    free(data);
+    return 1;
+}
+
+int XPending(Display *display)
+{
+    return s_server.pending;
+}
+
+int XNextEvent(Display *display, XEvent *event_return)
+{
+    memset(event_return, 0, sizeof(*event_return));
+    event_return->type = TEST_DAMAGE_EVENT + XDamageNotify;
+    s_server.pending--;
+    return 0;
+}
+
+Bool XShmGetImage(Display *dpy, Drawable d, XImage *image, int x, int y,
+                  unsigned long plane_mask)
+{
+    check(d == TEST_ROOT && image == &s_image && x == 0 && y == 0,
+          "bad XShmGetImage()");
+    s_server.full_grabs++;
+    return True;
+}
+
+XImage *XGetSubImage(Display *display, Drawable d, int x, int y,
+                     unsigned int width, unsigned int height,
+                     unsigned long plane_mask, int format, XImage *dest_image,
+                     int dest_x, int dest_y)
+{
+    XRectangle rect = { x, y, width, height };
+
+    check(d == TEST_ROOT && dest_image == &s_image && dest_x == x &&
+          dest_y == y && s_server.num_reads < TEST_MAX_RECTS,
+          "bad XGetSubImage()");
+    s_server.reads[s_server.num_reads++] = rect;
+    return s_server.fail ? NULL : dest_image;
+}
+
+// Not reached by the test, the daemon calls them when it opens the display.
+Display *XOpenDisplay(_Xconst char *display_name)
+{
+    return NULL;
+}
+
+int XCloseDisplay(Display *display)
+{
+    return 0;
+}
+
+XErrorHandler XSetErrorHandler(XErrorHandler handler)
+{
+    return NULL;
+}
+
+int XSync(Display *display, Bool discard)
+{
+    return 0;
+}
+
+Bool XShmQueryExtension(Display *display)
+{
+    return False;
+}
+
+XImage *XShmCreateImage(Display *display, Visual *visual, unsigned int depth,
+                        int format, char *data, XShmSegmentInfo *shminfo,
+                        unsigned int width, unsigned int height)
+{
+    return NULL;
+}
+
+Bool XShmAttach(Display *display, XShmSegmentInfo *shminfo)
+{
+    return False;
+}
+
+Bool XShmDetach(Display *display, XShmSegmentInfo *shminfo)
+{
+    return False;
+}
+
+static void test_server_reset(void)
+{
+    memset(&s_server, 0, sizeof(s_server));
+}
+
+static void test_server_damage(const XRectangle *rects, int num_rects)
+{
+    test_server_reset();
+    s_server.pending = 1;
+    memcpy(s_server.rects, rects, num_rects * sizeof(rects[0]));
+    s_server.num_rects = num_rects;
+}
+
+// Checks that the segments with a damaged pixel and only those have seq,
+// the pixels of each segment are looked at one by one.
+static void check_segments(const XRectangle *rects, int num_rects,
+                           unsigned int seq, const char *name)
+{
+    static bool damaged[FRAME_WIDTH * FRAME_HEIGHT];
+    bool marked;
+    int x, y, i, wrong = 0;
+
+    memset(damaged, 0, sizeof(damaged));
+    for (i = 0; i < num_rects; i++) {
+        for (y = rects[i].y; y < rects[i].y + rects[i].height; y++) {
+            for (x = rects[i].x; x < rects[i].x + rects[i].width; x++) {
+                if (x >= 0 && x < FRAME_WIDTH && y >= 0 && y < FRAME_HEIGHT) {
+                    damaged[y * FRAME_WIDTH + x] = true;
+                }
+            }
+        }
+    }
+    for (i = 0; i < XWIN_NUM_SEGMENTS; i++) {
+        marked = false;
+        for (x = 0; x < XWIN_SEGMENT_PIXELS; x++) {
+            marked |= damaged[i * XWIN_SEGMENT_PIXELS + x];
+        }
+        if (marked != (s_capture.segment_seqs[i] == seq)) {
+            wrong++;
+        }
+    }
+    check(wrong == 0, "%s: %d segments marked wrong", name, wrong);
+}
+
+static void test_open(void)
+{
+    memset(&s_capture, 0, sizeof(s_capture));
+    s_screen.root = TEST_ROOT;
+    s_display.screens = &s_screen;
+    s_display.default_screen = 0;
+    s_capture.display = (Display *)&s_display;
+    s_capture.image = &s_image;
+    check(xdamage_open(&s_capture) && s_capture.damage != 0 &&
+          s_capture.damage_all, "xdamage_open() failed");
+}
+
+// The first read takes the whole image, whatever the damage.
+static void test_first_read(void)
+{
+    const XRectangle all = { 0, 0, FRAME_WIDTH, FRAME_HEIGHT };
+
+    test_server_reset();
+    check(read_xdamage(&s_capture, 1) == FRAME_WIDTH * FRAME_HEIGHT,
+          "first read is not the whole image");
+    check(s_server.full_grabs == 1 && s_server.num_reads == 0 &&
+          !s_capture.damage_all, "first read: %d grabs, %d reads",
+          s_server.full_grabs, s_server.num_reads);
+    check_segments(&all, 1, 1, "first read");
+}
+
+static void test_no_damage(void)
+{
+    test_server_reset();
+    s_capture.unpublished = false;
+    check(read_xdamage(&s_capture, 2) == 0 && s_server.subtracts == 0,
+          "damage read without an event");
+    check(!xwin_damaged(&s_capture, 2) && s_capture.idle_ticks == 1,
+          "frame published without damage");
+}
+
+// Small damage is read back rectangle by rectangle, clipped to the screen.
+static void test_rects(void)
+{
+    const XRectangle rects[] = {
+        { 10, 10, 5, 5 },
+        { 315, 20, 6, 1 },    // one pixel into the next segment
+        { 319, 40, 2, 1 },    // from the last pixel of a segment
+        { 700, 470, 50, 50 }, // clipped right and bottom
+        { -5, 100, 20, 3 },   // clipped left
+        { 800, 0, 10, 10 },   // off the screen
+    };
+    const XRectangle clipped[] = {
+        { 10, 10, 5, 5 },
+        { 315, 20, 6, 1 },
+        { 319, 40, 2, 1 },
+        { 700, 470, 20, 10 },
+        { 0, 100, 15, 3 },
+    };
+    int num_rects = sizeof(rects) / sizeof(rects[0]);
+    int num_clipped = sizeof(clipped) / sizeof(clipped[0]);
+    int area = 0, i;
+
+    for (i = 0; i < num_rects; i++) {
+        area += rects[i].width * rects[i].height;
+    }
+    test_server_damage(rects, num_rects);
+    s_server.pending = 3; // collapsed into one read
+    check(read_xdamage(&s_capture, 3) == area, "wrong damage area");
+    check(s_server.pending == 0 && s_server.subtracts == 1,
+          "%d events left, %d subtracts", s_server.pending,
+          s_server.subtracts);
+    check(s_server.full_grabs == 0 && s_server.num_reads == num_clipped,
+          "rects: %d grabs, %d reads", s_server.full_grabs,
+          s_server.num_reads);
+    for (i = 0; i < s_server.num_reads && i < num_clipped; i++) {
+        check(memcmp(&s_server.reads[i], &clipped[i],
+                     sizeof(clipped[i])) == 0,
+              "read %d is %d,%d %dx%d", i, s_server.reads[i].x,
+              s_server.reads[i].y, s_server.reads[i].width,
+              s_server.reads[i].height);
+    }
+    check_segments(rects, num_rects, 3, "rects");
+}
+
+// Damage above XWIN_DAMAGE_MAX_RECT_AREA is one full grab, but only its
+// segments are marked.
+static void test_area_fallback(void)
+{
+    const XRectangle rects[] = {
+        { 0, 0, FRAME_WIDTH, 100 },
+        { 100, 300, 200, 100 },
+    };
+
+    check(FRAME_WIDTH * 100 + 200 * 100 > XWIN_DAMAGE_MAX_RECT_AREA &&
+          FRAME_WIDTH * 100 <= XWIN_DAMAGE_MAX_RECT_AREA,
+          "fallback rects don't fit XWIN_DAMAGE_MAX_RECT_AREA");
+    test_server_damage(rects, 2);
+    check(read_xdamage(&s_capture, 4) == FRAME_WIDTH * 100 + 200 * 100,
+          "wrong damage area");
+    check(s_server.full_grabs == 1 && s_server.num_reads == 0,
+          "fallback: %d grabs, %d reads", s_server.full_grabs,
+          s_server.num_reads);
+    check_segments(rects, 2, 4, "fallback");
+}
+
+static void test_read_failure(void)
+{
+    const XRectangle rect = { 10, 10, 5, 5 };
+
+    test_server_damage(&rect, 1);
+    s_server.fail = true;
+    check(read_xdamage(&s_capture, 5) == -1, "failed read not reported");
+}
+
+int main(void)
+{
+    test_open();
+    test_first_read();
+    test_no_damage();
+    test_rects();
+    test_area_fallback();
+    test_read_failure();
+
+    return test_result("test_xdamage");
+}
+#endif
@@ -0,0 +1,142 @@
+// Host test of the xwin segment stream: a changed pixel sends exactly the
+// segment that holds it. Built and run by ./build.sh test.
+
+#include "test.h"
+
+typedef struct {
+    const unsigned char *frame;
+    unsigned int hashs[XWIN_NUM_SEGMENTS];
+    int count;
+    unsigned int last_seq; // seq of the last frame sent
+    int encoding;
+    int indexes[XWIN_NUM_SEGMENTS]; // sent segments of the last frame
+    int num_indexes;
+    int num_rle;
+} SegmentStream;
+
+// Sends the frame grabbed at seq to a temporary file and reads back the
+// segment indexes. Returns false if the stream is malformed.
+static bool stream_frame(SegmentStream *stream, unsigned int seq)
+{
+    FILE *file = tmpfile();
+    unsigned char header[XWIN_RLE_HEADER_SIZE];
+    unsigned char payload[XWIN_BUF_SIZE];
+    unsigned int index, size;
+    bool ok = false;
+
+    if (file == NULL) {
+        die("tmpfile() failed");
+    }
+    if (!send_xwin_frame(fileno(file), stream->frame, stream->hashs,
+                         stream->count, s_xwin_capture.segment_seqs,
+                         stream->last_seq, stream->encoding)) {
+        goto out;
+    }
+    stream->count++;
+    stream->last_seq = seq;
+    stream->num_indexes = 0;
+    stream->num_rle = 0;
+
+    rewind(file);
+    while (fread(header, 1, 2, file) == 2) {
+        index = header[0] << 8 | header[1];
+        if (index == 0x0fff) {
+            ok = fread(payload, 1, XWIN_BUF_SIZE - 2, file)
+                    == XWIN_BUF_SIZE - 2 && fgetc(file) == EOF;
+            break;
+        }
+        size = XWIN_BUF_SIZE - 2;
+        if (index & XWIN_RLE_FLAG) {
+            if (fread(header + 2, 1, 2, file) != 2) {
+                break;
+            }
+            size = header[2] << 8 | header[3];
+            index &= ~XWIN_RLE_FLAG;
+            stream->num_rle++;
+        }
+        if (index >= XWIN_NUM_SEGMENTS || size > sizeof(payload) ||
+            fread(payload, 1, size, file) != size) {
+            break;
+        }
+        stream->indexes[stream->num_indexes++] = index;
+    }
+
+out:
+    fclose(file);
+    return ok;
+}
+
+// Marks the whole frame as changed, as a grab without damage does.
+static void touch_all(unsigned int seq)
+{
+    mark_xwin_segments(&s_xwin_capture, 0, 0, FRAME_WIDTH, FRAME_HEIGHT, seq);
+}
+
+static void test_pixels(int encoding)
+{
+    static const int pixels[][2] = {
+        {0, 0}, {5, 10}, {300, 200}, {719, 0}, {700, 300}, {719, 479},
+    };
+    unsigned char *frame = calloc(1, XWIN_FRAME_SIZE);
+    SegmentStream stream = { frame, {0,}, 0, 0, encoding, {0,}, 0, 0 };
+    unsigned int seq = 1;
+    int i, byte, offset, expected;
+
+    if (frame == NULL) {
+        die("calloc() failed");
+    }
+
+    touch_all(seq);
+    check(stream_frame(&stream, seq), "first frame malformed");
+    check(stream.num_indexes == XWIN_NUM_SEGMENTS,
+          "first frame sent %d segments", stream.num_indexes);
+
+    touch_all(++seq);
+    check(stream_frame(&stream, seq), "unchanged frame malformed");
+    check(stream.num_indexes == 0,
+          "unchanged frame sent %d segments", stream.num_indexes);
+
+    for (i = 0; i < (int)(sizeof(pixels) / sizeof(pixels[0])); i++) {
+        for (byte = 0; byte < 4; byte++) {
+            offset = (pixels[i][1] * FRAME_WIDTH + pixels[i][0]) * 4 + byte;
+            expected = offset / (XWIN_SEGMENT_PIXELS * 4);
+            frame[offset] ^= 0x01;
+
+            // the hashes must see it with a grab of the whole frame...
+            touch_all(++seq);
+            check(stream_frame(&stream, seq), "frame malformed");
+            check(stream.num_indexes == 1 && stream.indexes[0] == expected,
+                  "pixel %d,%d byte %d: %d segments, first %d, expected %d",
+                  pixels[i][0], pixels[i][1], byte, stream.num_indexes,
+                  stream.num_indexes ? stream.indexes[0] : -1, expected);
+            check(encoding == XWIN_ENCODING_RAW || stream.num_rle == 1,
+                  "pixel %d,%d not RLE encoded", pixels[i][0], pixels[i][1]);
+
+            // ...and the damage seqs with a grab of the damaged pixel
+            frame[offset] ^= 0x01;
+            mark_xwin_segments(&s_xwin_capture, pixels[i][0], pixels[i][1],
+                               1, 1, ++seq);
+            check(stream_frame(&stream, seq), "frame malformed");
+            check(stream.num_indexes == 1 && stream.indexes[0] == expected,
+                  "damaged pixel %d,%d: %d segments, expected %d",
+                  pixels[i][0], pixels[i][1], stream.num_indexes, expected);
+        }
+    }
+
+    // a change outside of the damage is not hashed
+    frame[0] ^= 0x01;
+    mark_xwin_segments(&s_xwin_capture, 0, 479, 1, 1, ++seq);
+    check(stream_frame(&stream, seq), "frame malformed");
+    check(stream.num_indexes == 0,
+          "undamaged change sent %d segments", stream.num_indexes);
+
+    free(frame);
+}
+
+int main(void)
+{
+    test_pixels(XWIN_ENCODING_RAW);
+    test_pixels(XWIN_ENCODING_RLE);
+
+    return test_result("test_xwin_segments");
+}